@@ -9153,6 +9153,32 @@ static void find_coreGL(void) {
 	}
 }
 
+#ifdef GLAD_SLIM
+/* Slim loader: only the functions and extensions listed in glad_slim.h are
+   resolved, instead of every core and extension entry point above */
+int gladLoadGLLoader(GLADloadproc load) {
+	GLVersion.major = 0; GLVersion.minor = 0;
+	glGetString = (PFNGLGETSTRINGPROC)load("glGetString");
+	if(glGetString == NULL) return 0;
+	if(glGetString(GL_VERSION) == NULL) return 0;
+	find_coreGL();
+#define GLAD_SLIM_PROC(type, name) glad_##name = (type)load(#name);
+#define GLAD_SLIM_EXT(name)
+#include "glad_slim.h"
+#undef GLAD_SLIM_PROC
+#undef GLAD_SLIM_EXT
+
+	if (!get_exts()) return 0;
+#define GLAD_SLIM_PROC(type, name)
+#define GLAD_SLIM_EXT(name) GLAD_##name = has_ext(#name);
+#include "glad_slim.h"
+#undef GLAD_SLIM_PROC
+#undef GLAD_SLIM_EXT
+	free_exts();
+	return GLVersion.major != 0 || GLVersion.minor != 0;
+}
+
+#else
 int gladLoadGLLoader(GLADloadproc load) {
 	GLVersion.major = 0; GLVersion.minor = 0;
 	glGetString = (PFNGLGETSTRINGPROC)load("glGetString");
@@ -9457,6 +9483,7 @@ int gladLoadGLLoader(GLADloadproc load) {
 	load_GL_SUN_vertex(load);
 	return GLVersion.major != 0 || GLVersion.minor != 0;
 }
+#endif /* GLAD_SLIM */
 
 static void load_GL_ES_VERSION_2_0(GLADloadproc load) {
 	if(!GLAD_GL_ES_VERSION_2_0) return;
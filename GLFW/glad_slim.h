@@ -0,0 +1,45 @@
+/*
+ * Entry points and extensions resolved by gladLoadGLLoader when glad.c is built
+ * with -DGLAD_SLIM. Every other glad function pointer is left NULL, so a GL
+ * function must be listed here before the program calls it.
+ *
+ * GLAD_SLIM_PROC(function pointer type, function name)
+ * GLAD_SLIM_EXT(extension name) - sets GLAD_<extension name>
+ */
+
+/* Needed by the loader itself to read the extension list */
+GLAD_SLIM_PROC(PFNGLGETINTEGERVPROC, glGetIntegerv)
+GLAD_SLIM_PROC(PFNGLGETSTRINGIPROC, glGetStringi)
+
+/* Sample_GL3_2D.cpp */
+GLAD_SLIM_PROC(PFNGLATTACHSHADERPROC, glAttachShader)
+GLAD_SLIM_PROC(PFNGLBINDBUFFERPROC, glBindBuffer)
+GLAD_SLIM_PROC(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray)
+GLAD_SLIM_PROC(PFNGLBUFFERDATAPROC, glBufferData)
+GLAD_SLIM_PROC(PFNGLCLEARPROC, glClear)
+GLAD_SLIM_PROC(PFNGLCLEARCOLORPROC, glClearColor)
+GLAD_SLIM_PROC(PFNGLCLEARDEPTHPROC, glClearDepth)
+GLAD_SLIM_PROC(PFNGLCOMPILESHADERPROC, glCompileShader)
+GLAD_SLIM_PROC(PFNGLCREATEPROGRAMPROC, glCreateProgram)
+GLAD_SLIM_PROC(PFNGLCREATESHADERPROC, glCreateShader)
+GLAD_SLIM_PROC(PFNGLDELETESHADERPROC, glDeleteShader)
+GLAD_SLIM_PROC(PFNGLDEPTHFUNCPROC, glDepthFunc)
+GLAD_SLIM_PROC(PFNGLDRAWARRAYSPROC, glDrawArrays)
+GLAD_SLIM_PROC(PFNGLENABLEPROC, glEnable)
+GLAD_SLIM_PROC(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray)
+GLAD_SLIM_PROC(PFNGLGENBUFFERSPROC, glGenBuffers)
+GLAD_SLIM_PROC(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays)
+GLAD_SLIM_PROC(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog)
+GLAD_SLIM_PROC(PFNGLGETPROGRAMIVPROC, glGetProgramiv)
+GLAD_SLIM_PROC(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog)
+GLAD_SLIM_PROC(PFNGLGETSHADERIVPROC, glGetShaderiv)
+GLAD_SLIM_PROC(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation)
+GLAD_SLIM_PROC(PFNGLLINKPROGRAMPROC, glLinkProgram)
+GLAD_SLIM_PROC(PFNGLPOLYGONMODEPROC, glPolygonMode)
+GLAD_SLIM_PROC(PFNGLSHADERSOURCEPROC, glShaderSource)
+GLAD_SLIM_PROC(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv)
+GLAD_SLIM_PROC(PFNGLUSEPROGRAMPROC, glUseProgram)
+GLAD_SLIM_PROC(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer)
+GLAD_SLIM_PROC(PFNGLVIEWPORTPROC, glViewport)
+
+/* No extensions are queried yet, e.g. GLAD_SLIM_EXT(GL_ARB_buffer_storage) */
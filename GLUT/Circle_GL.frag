@@ -0,0 +1,22 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 circlePosition;
+in vec3 fragColor;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Signed distance to the edge, in radii: negative inside the circle
+    float d = length(circlePosition) - 1.0;
+
+    // Fade out over one pixel across the edge, whatever the circle's size on screen
+    float w = fwidth(d);
+    float coverage = 1.0 - smoothstep(-w, w, d);
+    if (coverage <= 0.0)
+        discard;
+
+    color = vec4(fragColor, coverage);
+}
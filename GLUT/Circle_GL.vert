@@ -0,0 +1,27 @@
+#version 330 core
+
+// input data : a -1..1 quad, one instance per circle
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 2) in vec3 instanceCircle; // centre x,y and radius
+layout (location = 3) in vec3 instanceColor;
+
+// view-projection matrix, set once per frame and shared by all programs
+layout (std140) uniform Camera {
+    mat4 VP;
+};
+
+uniform mat3x2 M; // 2D affine model matrix of the batch
+
+// output data : used by fragment shader
+out vec2 circlePosition; // position on the unit circle, the edge is at length 1
+out vec3 fragColor;
+
+void main ()
+{
+    circlePosition = vertexPosition.xy;
+    fragColor = instanceColor;
+
+    // Scale the quad to the circle's radius and move it to its centre
+    vec2 p = instanceCircle.xy + instanceCircle.z * vertexPosition.xy;
+    gl_Position = VP * vec4(M * vec3(p, 1), 0, 1);
+}
@@ -4,7 +4,17 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 1) in vec3 vertexColor;
 
-uniform mat4 MVP;
+// per-instance data : only read when drawing instanced
+layout (location = 2) in vec2 instanceOffset;
+layout (location = 3) in vec3 instanceColor;
+
+// view-projection matrix, set once per frame and shared by all programs
+layout (std140) uniform Camera {
+    mat4 VP;
+};
+
+uniform mat3x2 M; // 2D affine model matrix of the object being drawn
+uniform bool instanced;
 
 // output data : used by fragment shader
 out vec3 fragColor;
@@ -17,6 +27,13 @@ void main ()
     // to produce the color of each fragment
     fragColor = vertexColor;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Instances are offset in model space and tint the (white) mesh
+    if (instanced) {
+        v.xy += instanceOffset;
+        fragColor *= instanceColor;
+    }
+
+    // Output position of the vertex, in clip space : VP * M * position
+    v.xy = M * vec3(v.xy, 1);
+    gl_Position = VP * v;
 }
@@ -3,10 +3,21 @@
 #include <fstream>
 #include <vector>
 #include <map>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <cfloat>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
 #include <GL/glew.h>
 #include <GL/glu.h>
 #include <GL/freeglut.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <time.h>
+#include <unistd.h>
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
@@ -22,6 +33,10 @@ struct VAO {
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+
+    int FlatColor; // 1 if there is no color array and every vertex uses Color
+    GLfloat Color[3];
+    GLuint EnabledArrays; // bit i set once attribute i has been enabled on this VAO
 };
 typedef struct VAO VAO;
 
@@ -29,39 +44,742 @@ struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLuint CameraBuffer; // uniform buffer holding the frame's view-projection matrix
 } Matrices;
 
-GLuint programID;
+#define CAMERA_BLOCK_BINDING 0 // every program reads the "Camera" block from here
+
+/* A linked shader program, the locations of the uniforms set per draw, and how its
+   draws are blended */
+struct ShaderProgram {
+    GLuint ID;
+    GLint MatrixID; // per-object model matrix "M"
+    GLint InstancedID; // "instanced" switch, set while drawing per-instance geometry; -1 if absent
+    int Blend; // 1 to alpha blend its output over the frame
+};
+typedef struct ShaderProgram ShaderProgram;
+
+ShaderProgram scene_program; // vertex colored geometry, Sample_GL.*
+ShaderProgram circle_program; // SDF circles, Circle_GL.*
+
+/* Seconds on a monotonic clock, for frame timing */
+double monotonicTime ()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Heap allocation counter - every operator new in the program, on any thread, is
+   counted so the profiler can show that a steady-state frame never allocates */
+atomic<long> heap_allocations(0);
+
+void* operator new (size_t bytes)
+{
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(bytes ? bytes : 1);
+    if (!p)
+        throw bad_alloc();
+    return p;
+}
+
+void* operator new[] (size_t bytes)
+{
+    return operator new(bytes);
+}
+
+void operator delete (void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete (void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[] (void* p, size_t) noexcept
+{
+    free(p);
+}
+
+/* Frame arena - a block allocated once and handed out by bumping an offset, for data
+   that only lives until the end of a tick or a frame. Resetting it frees everything
+   at once. Each arena belongs to one thread */
+struct FrameArena {
+    const char* name; // for the overflow error
+    char* base;
+    size_t capacity;
+    size_t used;
+    size_t peak; // highest 'used' seen at a reset
+};
+typedef struct FrameArena FrameArena;
+
+#define TICK_ARENA_BYTES (2*1024*1024) // the collision grid's arrays at MAX_BRICKS take about 1.4MB
+#define FRAME_ARENA_BYTES (256*1024)
+FrameArena tick_arena;  // simulation thread, reset after every updateGame
+FrameArena frame_arena; // render thread, reset after every draw
+
+void initArena (FrameArena& arena, const char* name, size_t capacity)
+{
+    arena.name = name;
+    arena.base = (char*) malloc(capacity);
+    if (!arena.base) {
+        cout << "Error: Cannot allocate the " << arena.name << " arena" << endl;
+        exit(1);
+    }
+    arena.capacity = capacity;
+    arena.used = 0;
+    arena.peak = 0;
+}
+
+/* 'bytes' aligned to 'alignment' (a power of two); running out is a sizing bug, so it is fatal */
+void* arenaAlloc (FrameArena& arena, size_t bytes, size_t alignment)
+{
+    size_t offset = (arena.used + alignment-1) & ~(alignment-1);
+    if (offset + bytes > arena.capacity) {
+        cout << "Error: The " << arena.name << " arena is out of space (" << arena.capacity << " bytes)" << endl;
+        exit(1);
+    }
+    arena.used = offset + bytes;
+    return arena.base + offset;
+}
+
+/* Uninitialized array of 'count' T, valid until the arena is reset */
+template <typename T>
+T* arenaArray (FrameArena& arena, size_t count)
+{
+    return (T*) arenaAlloc(arena, count*sizeof(T), alignof(T));
+}
+
+void resetArena (FrameArena& arena)
+{
+    arena.peak = max(arena.peak, arena.used);
+    arena.used = 0;
+}
+
+/* Frame profiler - CPU time of named scopes plus GPU time of draw() through
+   GL_TIME_ELAPSED queries, kept for the last PROFILE_HISTORY frames. Scopes timed on
+   the simulation thread are added to the frame during which their tick finished */
+#define PROFILE_HISTORY 1024
+#define GPU_QUERY_RING 4 // frames a timer query may stay in flight before we skip measuring
+
+enum ProfileScope { PROFILE_SIMULATION, PROFILE_SPAWN, PROFILE_COLLISION, PROFILE_LASER, PROFILE_DRAW, PROFILE_SWAP, PROFILE_GPU, NUM_PROFILE_SCOPES };
+const char* profile_scope_names[NUM_PROFILE_SCOPES] = { "simulation", "spawn", "collision", "laser", "draw", "swap", "gpu" };
+
+enum ProfileCounter { COUNTER_DRAWS, COUNTER_STATE_CALLS, COUNTER_STATE_ELIDED, COUNTER_STREAM_STALLS, COUNTER_HEAP_ALLOCATIONS, NUM_PROFILE_COUNTERS };
+const char* profile_counter_names[NUM_PROFILE_COUNTERS] = { "draws", "state_calls", "state_elided", "stream_stalls", "heap_allocations" };
+
+struct Profiler {
+    bool enabled;
+    const char* csv_path; // NULL for no CSV dump
+    double frame[PROFILE_HISTORY][NUM_PROFILE_SCOPES]; // ms per scope, ring of recent frames; -1 if not measured
+    double current[NUM_PROFILE_SCOPES]; // ms accumulated so far this frame
+    double scope_start[NUM_PROFILE_SCOPES];
+    bool measured[NUM_PROFILE_SCOPES]; // scope was entered this frame
+    // Simulation thread: its own open scopes, and the finished ones waiting for profileFrameEnd
+    double sim_current[NUM_PROFILE_SCOPES];
+    double sim_scope_start[NUM_PROFILE_SCOPES];
+    bool sim_measured[NUM_PROFILE_SCOPES];
+    std::mutex sim_lock; // guards the two below
+    double sim_done[NUM_PROFILE_SCOPES];
+    bool sim_done_measured[NUM_PROFILE_SCOPES];
+    long int counts[PROFILE_HISTORY][NUM_PROFILE_COUNTERS]; // events per frame, same ring as 'frame'
+    long int current_counts[NUM_PROFILE_COUNTERS];
+    long int num_frames;
+    long int heap_allocations; // heap_allocations at the end of the last frame
+    GLuint queries[GPU_QUERY_RING];
+    long int query_frame[GPU_QUERY_RING]; // frame a query is measuring, -1 when free
+    bool gpu_active;
+    std::thread::id thread; // the render thread; scopes on any other thread are the simulation's
+};
+typedef struct Profiler Profiler;
+Profiler profiler;
+
+/* Create the timer queries, must be called with a current GL context */
+void initProfiler ()
+{
+    profiler.thread = std::this_thread::get_id();
+    if (!profiler.enabled)
+        return;
+    glGenQueries (GPU_QUERY_RING, profiler.queries);
+    for (int i=0; i<GPU_QUERY_RING; i++)
+        profiler.query_frame[i] = -1;
+}
+
+/* True if profiling is on and this is the thread that owns the profiler */
+bool profiling ()
+{
+    return profiler.enabled && std::this_thread::get_id() == profiler.thread;
+}
+
+void profileBegin (int scope)
+{
+    if (!profiler.enabled)
+        return;
+    if (profiling()) {
+        profiler.scope_start[scope] = monotonicTime();
+        profiler.measured[scope] = true;
+    }
+    else {
+        profiler.sim_scope_start[scope] = monotonicTime();
+        profiler.sim_measured[scope] = true;
+    }
+}
+
+void profileEnd (int scope)
+{
+    if (!profiler.enabled)
+        return;
+    if (profiling())
+        profiler.current[scope] += 1000*(monotonicTime() - profiler.scope_start[scope]);
+    else
+        profiler.sim_current[scope] += 1000*(monotonicTime() - profiler.sim_scope_start[scope]);
+}
+
+/* Hand the simulation thread's finished scopes over to the current frame */
+void profileTickEnd ()
+{
+    if (!profiler.enabled || profiling())
+        return;
+    std::lock_guard<std::mutex> hold(profiler.sim_lock);
+    for (int s=0; s<NUM_PROFILE_SCOPES; s++) {
+        if (!profiler.sim_measured[s])
+            continue;
+        profiler.sim_done[s] += profiler.sim_current[s];
+        profiler.sim_done_measured[s] = true;
+        profiler.sim_current[s] = 0;
+        profiler.sim_measured[s] = false;
+    }
+}
+
+/* Add 'n' events to a per-frame counter */
+void profileCount (int counter, long int n=1)
+{
+    if (profiling())
+        profiler.current_counts[counter] += n;
+}
+
+/* Store the results of finished timer queries, never waiting for the GPU */
+void collectGPUQueries ()
+{
+    for (int i=0; i<GPU_QUERY_RING; i++) {
+        if (profiler.query_frame[i] < 0)
+            continue;
+        GLint available = 0;
+        glGetQueryObjectiv (profiler.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            continue;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v (profiler.queries[i], GL_QUERY_RESULT, &nanoseconds);
+        long int frame = profiler.query_frame[i];
+        // Frame 0 is warm-up (shader JIT on llvmpipe), and some drivers report nonsense for it
+        if (frame > 0 && profiler.num_frames - frame <= PROFILE_HISTORY)
+            profiler.frame[frame % PROFILE_HISTORY][PROFILE_GPU] = nanoseconds/1e6;
+        profiler.query_frame[i] = -1;
+    }
+}
+
+/* Start timing this frame's GPU work, unless every query is still in flight */
+void profileGPUBegin ()
+{
+    if (!profiler.enabled)
+        return;
+    int slot = profiler.num_frames % GPU_QUERY_RING;
+    if (profiler.query_frame[slot] >= 0)
+        collectGPUQueries ();
+    if (profiler.query_frame[slot] >= 0)
+        return; // waiting for the result would stall the pipeline, skip this frame
+
+    glBeginQuery (GL_TIME_ELAPSED, profiler.queries[slot]);
+    profiler.query_frame[slot] = profiler.num_frames;
+    profiler.gpu_active = true;
+}
+
+void profileGPUEnd ()
+{
+    if (profiler.gpu_active)
+        glEndQuery (GL_TIME_ELAPSED);
+    profiler.gpu_active = false;
+}
+
+/* Close the current frame: move its scope times into the history */
+void profileFrameEnd ()
+{
+    if (!profiler.enabled)
+        return;
+    long int allocations = heap_allocations.load(memory_order_relaxed);
+    profileCount(COUNTER_HEAP_ALLOCATIONS, allocations - profiler.heap_allocations);
+    profiler.heap_allocations = allocations;
+
+    double* row = profiler.frame[profiler.num_frames % PROFILE_HISTORY];
+    {
+        std::lock_guard<std::mutex> hold(profiler.sim_lock);
+        for (int s=0; s<NUM_PROFILE_SCOPES; s++) {
+            // -1 marks a scope that ran on neither thread this frame
+            bool measured = profiler.measured[s] || profiler.sim_done_measured[s];
+            row[s] = measured ? profiler.current[s] + profiler.sim_done[s] : -1;
+            profiler.current[s] = 0;
+            profiler.measured[s] = false;
+            profiler.sim_done[s] = 0;
+            profiler.sim_done_measured[s] = false;
+        }
+    }
+    row[PROFILE_GPU] = -1; // filled in by collectGPUQueries once the GPU is done
+    for (int c=0; c<NUM_PROFILE_COUNTERS; c++) {
+        profiler.counts[profiler.num_frames % PROFILE_HISTORY][c] = profiler.current_counts[c];
+        profiler.current_counts[c] = 0;
+    }
+    profiler.num_frames++;
+    collectGPUQueries ();
+}
+
+/* Print min/avg/p99 of every scope and the per-frame counts over the recorded frames, and write the CSV */
+void printProfileSummary ()
+{
+    if (!profiler.enabled)
+        return;
+    long int frames = min(profiler.num_frames, (long int) PROFILE_HISTORY);
+    long int first = profiler.num_frames - frames;
+
+    cout << "Profile of last " << frames << " frames (ms): min avg p99" << endl;
+    vector<double> samples;
+    for (int s=0; s<NUM_PROFILE_SCOPES; s++) {
+        samples.clear();
+        double total = 0;
+        for (long int f=first; f<profiler.num_frames; f++) {
+            double ms = profiler.frame[f % PROFILE_HISTORY][s];
+            if (ms < 0)
+                continue;
+            samples.push_back(ms);
+            total += ms;
+        }
+        cout << "  " << profile_scope_names[s] << ": ";
+        if (samples.empty()) {
+            cout << "no samples" << endl;
+            continue;
+        }
+        sort(samples.begin(), samples.end());
+        size_t p99 = (size_t) ceil(0.99*samples.size()) - 1;
+        cout << samples[0] << " " << total/samples.size() << " " << samples[p99] << endl;
+    }
+
+    cout << "Counts per frame: min avg max" << endl;
+    for (int c=0; c<NUM_PROFILE_COUNTERS; c++) {
+        long int lowest = 0, highest = 0, total = 0;
+        for (long int f=first; f<profiler.num_frames; f++) {
+            long int n = profiler.counts[f % PROFILE_HISTORY][c];
+            if (f == first || n < lowest)
+                lowest = n;
+            if (n > highest)
+                highest = n;
+            total += n;
+        }
+        cout << "  " << profile_counter_names[c] << ": " << lowest << " "
+             << (frames > 0 ? (double) total/frames : 0) << " " << highest << endl;
+    }
+
+    if (!profiler.csv_path)
+        return;
+    ofstream csv(profiler.csv_path);
+    if (!csv.is_open()) {
+        cout << "Error: Cannot write profile to " << profiler.csv_path << endl;
+        return;
+    }
+    csv << "frame";
+    for (int s=0; s<NUM_PROFILE_SCOPES; s++)
+        csv << "," << profile_scope_names[s];
+    for (int c=0; c<NUM_PROFILE_COUNTERS; c++)
+        csv << "," << profile_counter_names[c];
+    csv << endl;
+    for (long int f=first; f<profiler.num_frames; f++) {
+        csv << f;
+        for (int s=0; s<NUM_PROFILE_SCOPES; s++) {
+            double ms = profiler.frame[f % PROFILE_HISTORY][s];
+            csv << ",";
+            if (ms >= 0)
+                csv << ms;
+        }
+        for (int c=0; c<NUM_PROFILE_COUNTERS; c++)
+            csv << "," << profiler.counts[f % PROFILE_HISTORY][c];
+        csv << endl;
+    }
+}
+
+/* GL state cache - remembers the bound program, VAO, array buffer, polygon mode,
+   enabled attributes and constant color, and skips calls that would not change them.
+   Everything that binds these must go through it, or the cache goes stale */
+struct GLStateCache {
+    GLuint program;
+    GLuint vertex_array;
+    GLuint array_buffer;
+    GLenum polygon_mode;
+    bool blend;
+    GLfloat color[3]; // current value of attribute 1 while it has no array
+    bool color_valid;
+};
+typedef struct GLStateCache GLStateCache;
+GLStateCache gl_state = { 0, 0, 0, GL_FILL, false, {0, 0, 0}, false };
+
+/* Count a state call as issued (true) or elided (false), returns 'changed' */
+bool stateChanged (bool changed)
+{
+    profileCount(changed ? COUNTER_STATE_CALLS : COUNTER_STATE_ELIDED);
+    return changed;
+}
+
+void cachedUseProgram (GLuint program)
+{
+    if (stateChanged(gl_state.program != program)) {
+        glUseProgram (program);
+        gl_state.program = program;
+    }
+}
+
+void cachedBindVertexArray (GLuint vertex_array)
+{
+    if (stateChanged(gl_state.vertex_array != vertex_array)) {
+        glBindVertexArray (vertex_array);
+        gl_state.vertex_array = vertex_array;
+    }
+}
+
+void cachedBindArrayBuffer (GLuint buffer)
+{
+    if (stateChanged(gl_state.array_buffer != buffer)) {
+        glBindBuffer (GL_ARRAY_BUFFER, buffer);
+        gl_state.array_buffer = buffer;
+    }
+}
+
+void cachedPolygonMode (GLenum mode)
+{
+    if (stateChanged(gl_state.polygon_mode != mode)) {
+        glPolygonMode (GL_FRONT_AND_BACK, mode);
+        gl_state.polygon_mode = mode;
+    }
+}
+
+void cachedBlend (bool enabled)
+{
+    if (stateChanged(gl_state.blend != enabled)) {
+        if (enabled)
+            glEnable (GL_BLEND);
+        else
+            glDisable (GL_BLEND);
+        gl_state.blend = enabled;
+    }
+}
+
+/* Enable an attribute array of vao, which must be the bound VAO */
+void cachedEnableVertexAttribArray (struct VAO* vao, GLuint index)
+{
+    if (stateChanged(!(vao->EnabledArrays & (1u << index)))) {
+        glEnableVertexAttribArray (index);
+        vao->EnabledArrays |= 1u << index;
+    }
+}
+
+/* Set the constant color read by attribute 1 when it has no array */
+void cachedVertexColor (const GLfloat* color)
+{
+    if (stateChanged(!gl_state.color_valid || gl_state.color[0] != color[0] ||
+                     gl_state.color[1] != color[1] || gl_state.color[2] != color[2])) {
+        glVertexAttrib3f (1, color[0], color[1], color[2]);
+        memcpy (gl_state.color, color, sizeof(gl_state.color));
+        gl_state.color_valid = true;
+    }
+}
+
+/* Streaming buffer - per-frame vertex and instance data is copied into one large
+   buffer used as a ring of STREAM_FRAMES regions, and drawn from its offset there.
+   Each region is fenced when its frame is submitted and only rewritten once the GPU
+   has passed the fence, so neither allocation nor implicit driver sync is needed.
+   With GL 4.4 / ARB_buffer_storage the buffer stays mapped for its whole life,
+   otherwise every write maps its range unsynchronized */
+#define STREAM_FRAMES 3
+#define STREAM_REGION_SIZE (1024*1024) // room for MAX_BRICKS brick instances plus lines and circles
+
+struct StreamBuffer {
+    GLuint Buffer;
+    GLubyte* mapped; // persistent mapping, NULL when writes map their own range
+    int region; // region written by the current frame
+    GLintptr head; // next free byte
+    GLsync fence[STREAM_FRAMES]; // signalled once the GPU is done with each region
+};
+typedef struct StreamBuffer StreamBuffer;
+StreamBuffer stream;
+
+void initStreamBuffer ()
+{
+    GLsizeiptr size = STREAM_FRAMES*STREAM_REGION_SIZE;
+    glGenBuffers (1, &stream.Buffer);
+    cachedBindArrayBuffer (stream.Buffer);
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage (GL_ARRAY_BUFFER, size, NULL, flags);
+        stream.mapped = (GLubyte*) glMapBufferRange (GL_ARRAY_BUFFER, 0, size, flags);
+    }
+    else {
+        glBufferData (GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        stream.mapped = NULL;
+    }
+    stream.region = 0;
+    stream.head = 0;
+    for (int i=0; i<STREAM_FRAMES; i++)
+        stream.fence[i] = 0;
+}
+
+/* Start writing the next region, waiting for the GPU if it still reads from it */
+void beginStreamFrame ()
+{
+    stream.region = (stream.region + 1) % STREAM_FRAMES;
+    stream.head = stream.region*STREAM_REGION_SIZE;
+
+    GLsync& fence = stream.fence[stream.region];
+    if (!fence)
+        return;
+    GLenum status = glClientWaitSync (fence, 0, 0);
+    if (status == GL_TIMEOUT_EXPIRED) {
+        profileCount(COUNTER_STREAM_STALLS);
+        while (status == GL_TIMEOUT_EXPIRED)
+            status = glClientWaitSync (fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000); // 1s
+    }
+    glDeleteSync (fence);
+    fence = 0;
+}
+
+/* Fence the current region once every draw reading it has been submitted */
+void endStreamFrame ()
+{
+    stream.fence[stream.region] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* Copy 'bytes' of data into the current region, aligned to 'alignment' (the vertex
+   stride) so it can be drawn from the returned offset. Returns -1 when the region is full */
+GLintptr streamData (const void* data, GLsizeiptr bytes, GLsizeiptr alignment)
+{
+    GLintptr offset = (stream.head + alignment-1) / alignment * alignment;
+    if (offset + bytes > (stream.region+1)*STREAM_REGION_SIZE)
+        return -1;
+    stream.head = offset + bytes;
+
+    if (stream.mapped) {
+        memcpy (stream.mapped + offset, data, bytes);
+        return offset;
+    }
+
+    // The fence already guarantees the GPU is done with this range
+    cachedBindArrayBuffer (stream.Buffer);
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+    void* range = glMapBufferRange (GL_ARRAY_BUFFER, offset, bytes, flags);
+    memcpy (range, data, bytes);
+    glUnmapBuffer (GL_ARRAY_BUFFER);
+    return offset;
+}
+
+/* Shader source loader - every file is read in a single call and cached with its
+   #include "file" lines expanded, so snippets shared by several shaders are read once */
+#define MAX_SHADER_INCLUDE_DEPTH 16
+
+map<string,string> shader_source_cache; // path -> expanded source
+
+/* Read a whole file into 'contents', false if it cannot be opened */
+bool readWholeFile (const string& path, string& contents)
+{
+    std::ifstream Stream(path.c_str(), std::ios::in | std::ios::binary);
+    if(!Stream.is_open())
+        return false;
+    Stream.seekg(0, std::ios::end);
+    contents.resize((size_t) Stream.tellg());
+    Stream.seekg(0, std::ios::beg);
+    if (!contents.empty())
+        Stream.read(&contents[0], contents.size());
+    return true;
+}
+
+/* Source of 'path' with includes expanded; paths in #include are relative to the including file */
+const string& loadShaderSource (const string& path, int depth=0)
+{
+    map<string,string>::iterator cached = shader_source_cache.find(path);
+    if (cached != shader_source_cache.end())
+        return cached->second;
+
+    string source;
+    if (!readWholeFile(path, source))
+        printf("Cannot open shader file : %s\n", path.c_str());
+
+    string directory;
+    size_t slash = path.find_last_of('/');
+    if (slash != string::npos)
+        directory = path.substr(0, slash+1);
+
+    string expanded;
+    expanded.reserve(source.size());
+    size_t line_start = 0;
+    while (line_start < source.size()) {
+        size_t line_end = source.find('\n', line_start);
+        if (line_end == string::npos)
+            line_end = source.size();
+
+        size_t directive = source.find_first_not_of(" \t", line_start);
+        size_t open_quote, close_quote;
+        if (directive < line_end && source.compare(directive, 8, "#include") == 0 &&
+            (open_quote = source.find('"', directive)) < line_end &&
+            (close_quote = source.find('"', open_quote+1)) < line_end) {
+            string included = directory + source.substr(open_quote+1, close_quote-open_quote-1);
+            if (depth < MAX_SHADER_INCLUDE_DEPTH)
+                expanded += loadShaderSource(included, depth+1);
+            else
+                printf("Shader includes nested too deeply : %s\n", included.c_str());
+            expanded += '\n';
+        }
+        else
+            expanded.append(source, line_start, line_end+1-line_start);
+        line_start = line_end+1;
+    }
+
+    return shader_source_cache[path] = expanded;
+}
+
+/* Program binary cache - linked programs are saved with glGetProgramBinary and
+   reloaded on the next start, skipping compilation while sources and driver match */
+struct ProgramCacheHeader {
+    char magic[8];
+    unsigned long long key; // hash of both sources and the driver strings
+    GLenum format;
+    GLint length;
+};
+typedef struct ProgramCacheHeader ProgramCacheHeader;
+
+static const char program_cache_magic[8] = { 'G','L','P','R','O','G','0','1' };
+
+/* 64-bit FNV-1a, continuing from 'hash' */
+unsigned long long hashBytes (const char* data, size_t length, unsigned long long hash=14695981039346656037ULL)
+{
+    for (size_t i=0; i<length; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Key for a program: its sources plus everything that identifies the driver build */
+unsigned long long programCacheKey (const std::string& vertex_code, const std::string& fragment_code)
+{
+    unsigned long long key = hashBytes(vertex_code.data(), vertex_code.size());
+    key = hashBytes(fragment_code.data(), fragment_code.size(), key);
+    GLenum driver_strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (int i=0; i<3; i++) {
+        const char* str = (const char*) glGetString(driver_strings[i]);
+        if (str)
+            key = hashBytes(str, strlen(str), key);
+    }
+    return key;
+}
+
+/* True if the context can give out and take back program binaries */
+bool programCacheSupported ()
+{
+    if (!(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+        return false;
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+/* Create a program from the cached binary, returns 0 if it is missing or stale */
+GLuint loadProgramBinary (const std::string& cache_path, unsigned long long key)
+{
+    std::ifstream CacheStream(cache_path.c_str(), std::ios::in | std::ios::binary);
+    if(!CacheStream.is_open())
+        return 0;
+
+    ProgramCacheHeader header;
+    CacheStream.read((char*) &header, sizeof(header));
+    if (!CacheStream || memcmp(header.magic, program_cache_magic, sizeof(header.magic)) != 0 ||
+        header.key != key || header.length <= 0)
+        return 0;
+
+    std::vector<char> binary(header.length);
+    CacheStream.read(&binary[0], header.length);
+    if (!CacheStream)
+        return 0;
+
+    // The driver may still reject a binary, e.g. after an update that kept its version string
+    GLuint ProgramID = glCreateProgram();
+    glProgramBinary(ProgramID, header.format, &binary[0], header.length);
+    GLint Result = GL_FALSE;
+    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+    if (Result != GL_TRUE) {
+        glDeleteProgram(ProgramID);
+        return 0;
+    }
+    return ProgramID;
+}
+
+/* Write a linked program's binary to the cache */
+void saveProgramBinary (GLuint ProgramID, const std::string& cache_path, unsigned long long key)
+{
+    ProgramCacheHeader header;
+    memcpy(header.magic, program_cache_magic, sizeof(header.magic));
+    header.key = key;
+    glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &header.length);
+    if (header.length <= 0)
+        return;
+
+    std::vector<char> binary(header.length);
+    glGetProgramBinary(ProgramID, header.length, NULL, &header.format, &binary[0]);
+
+    std::ofstream CacheStream(cache_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!CacheStream.is_open()) {
+        printf("Cannot write program cache : %s\n", cache_path.c_str());
+        return;
+    }
+    CacheStream.write((const char*) &header, sizeof(header));
+    CacheStream.write(&binary[0], header.length);
+}
+
+/* Cache file for a program: next to the vertex shader, named after both shaders.
+   Only the fragment shader's file name is used, so its directory never ends up
+   inside the cache path */
+std::string programCachePath (const std::string& vertex_path, const std::string& fragment_path)
+{
+    size_t slash = fragment_path.find_last_of('/');
+    std::string fragment_name = (slash == std::string::npos) ? fragment_path : fragment_path.substr(slash+1);
+    return vertex_path + "." + fragment_name + ".bin";
+}
 
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
+	// Read the shader code, with #include lines already expanded
+	const std::string& VertexShaderCode = loadShaderSource(vertex_file_path);
+	const std::string& FragmentShaderCode = loadShaderSource(fragment_file_path);
+
+	// Warm start: reuse the program linked on a previous run if nothing changed
+	bool UseCache = programCacheSupported();
+	std::string CachePath = programCachePath(vertex_file_path, fragment_file_path);
+	unsigned long long CacheKey = 0;
+	if (UseCache) {
+		CacheKey = programCacheKey(VertexShaderCode, FragmentShaderCode);
+		GLuint CachedProgramID = loadProgramBinary(CachePath, CacheKey);
+		if (CachedProgramID) {
+			printf("Loaded cached program : %s\n", CachePath.c_str());
+			return CachedProgramID;
+		}
+	}
+
 	// Create the shaders
 	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
 	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
-	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
-	}
-
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
-	}
-
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
@@ -96,6 +814,8 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	if (UseCache)
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
@@ -104,6 +824,8 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
 	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
 	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+	if (UseCache && Result == GL_TRUE)
+		saveProgramBinary(ProgramID, CachePath, CacheKey);
 
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
@@ -118,14 +840,16 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
     vao->FillMode = fill_mode;
+    vao->EnabledArrays = 0;
+    vao->FlatColor = 0;
 
     // Create Vertex Array Object
     glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    cachedBindArrayBuffer (vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
@@ -136,7 +860,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           (void*)0            // array buffer offset
                           );
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+    cachedBindArrayBuffer (vao->ColorBuffer); // Bind the VBO colors 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
@@ -150,57 +874,342 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     return vao;
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+/* Mark vao as flat colored: attribute 1 has no array and reads this color for every vertex */
+void setFlatColor (struct VAO* vao, const GLfloat red, const GLfloat green, const GLfloat blue)
+{
+    vao->FlatColor = 1;
+    vao->ColorBuffer = 0;
+    vao->Color[0] = red;
+    vao->Color[1] = green;
+    vao->Color[2] = blue;
+}
+
+/* Generate VAO, VBO and return VAO handle - Common Color for all vertices, no color VBO */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = fill_mode;
+    vao->EnabledArrays = 0;
+    setFlatColor(vao, red, green, blue);
+
+    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
+
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    cachedBindArrayBuffer (vao->VertexBuffer); // Bind the VBO vertices
+    glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+    glVertexAttribPointer(
+                          0,                  // attribute 0. Vertices
+                          3,                  // size (x,y,z)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          0,                  // stride
+                          (void*)0            // array buffer offset
+                          );
+
+    return vao;
+}
+
+/* Compact vertex for flat 2D geometry: 12 bytes instead of 24 across two buffers */
+struct Vertex2D {
+    GLfloat x, y;
+    GLubyte r, g, b, a; // normalized to 0..1 by the vertex attribute
+};
+typedef struct Vertex2D Vertex2D;
+
+/* Convert a 0..1 color channel to a byte */
+GLubyte colorByte (GLfloat c)
+{
+    if (c <= 0) return 0;
+    if (c >= 1) return 255;
+    return (GLubyte) (c*255 + 0.5f);
+}
+
+/* Replace the vertices of an interleaved 2D object, as created by create2DObject below */
+void fill2DObject (struct VAO* vao, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data)
+{
+    std::vector<Vertex2D> vertices(numVertices);
     for (int i=0; i<numVertices; i++) {
-        color_buffer_data [3*i] = red;
-        color_buffer_data [3*i + 1] = green;
-        color_buffer_data [3*i + 2] = blue;
+        vertices[i].x = vertex_buffer_data[3*i];
+        vertices[i].y = vertex_buffer_data[3*i + 1];
+        vertices[i].r = colorByte(color_buffer_data[3*i]);
+        vertices[i].g = colorByte(color_buffer_data[3*i + 1]);
+        vertices[i].b = colorByte(color_buffer_data[3*i + 2]);
+        vertices[i].a = 255;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    cachedBindArrayBuffer (vao->VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(Vertex2D), vertices.data(), GL_STATIC_DRAW);
+    vao->NumVertices = numVertices;
 }
 
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Generate VAO and a single interleaved VBO for geometry lying in the z=0 plane.
+   Takes the same x,y,z / r,g,b arrays as create3DObject; z is dropped */
+struct VAO* create2DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
-    // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
-
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = fill_mode;
+    vao->EnabledArrays = 0;
+    vao->ColorBuffer = 0; // colors are interleaved into VertexBuffer
+    vao->FlatColor = 0;
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - interleaved vertices and colors
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    fill2DObject (vao, numVertices, vertex_buffer_data, color_buffer_data); // Copy the vertices into VBO
+    glVertexAttribPointer(
+                          0,                  // attribute 0. Vertices
+                          2,                  // size (x,y), z reads as 0
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          sizeof(Vertex2D),   // stride
+                          (void*)0            // array buffer offset
+                          );
+    glVertexAttribPointer(
+                          1,                  // attribute 1. Color
+                          4,                  // size (r,g,b,a)
+                          GL_UNSIGNED_BYTE,   // type
+                          GL_TRUE,            // normalized?
+                          sizeof(Vertex2D),   // stride
+                          (void*)(2*sizeof(GLfloat)) // array buffer offset
+                          );
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    return vao;
 }
 
-/**************************
- * Customizable functions *
- **************************
- */
-struct COLOR {
-    float r;
-    float g;
-    float b;
-};
+/* Generate VAO and a positions-only VBO (8 bytes per vertex) for flat colored 2D geometry */
+struct VAO* create2DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
+{
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->FillMode = fill_mode;
+    vao->EnabledArrays = 0;
+    setFlatColor(vao, red, green, blue);
+
+    std::vector<GLfloat> positions(2*numVertices);
+    for (int i=0; i<numVertices; i++) {
+        positions[2*i] = vertex_buffer_data[3*i];
+        positions[2*i + 1] = vertex_buffer_data[3*i + 1];
+    }
+
+    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
+
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO
+    cachedBindArrayBuffer (vao->VertexBuffer); // Bind the VBO vertices
+    glBufferData (GL_ARRAY_BUFFER, positions.size()*sizeof(GLfloat), &positions[0], GL_STATIC_DRAW); // Copy the vertices into VBO
+    glVertexAttribPointer(
+                          0,                  // attribute 0. Vertices
+                          2,                  // size (x,y), z reads as 0
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          0,                  // stride
+                          (void*)0            // array buffer offset
+                          );
+
+    return vao;
+}
+
+/* Make the VAO current: its fill mode, vertex arrays and color source.
+   The VAO keeps its attribute buffers, so no GL_ARRAY_BUFFER binding is needed to draw */
+void bind3DObject (struct VAO* vao)
+{
+    // Change the Fill Mode for this object
+    cachedPolygonMode (vao->FillMode);
+
+    // Bind the VAO to use
+    cachedBindVertexArray (vao->VertexArrayID);
+
+    // Enable Vertex Attribute 0 - 3d Vertices
+    cachedEnableVertexAttribArray(vao, 0);
+
+    if (vao->FlatColor) {
+        // Attribute 1 has no array here, so every vertex reads this constant color
+        cachedVertexColor(vao->Color);
+    }
+    else {
+        // Enable Vertex Attribute 1 - Color
+        cachedEnableVertexAttribArray(vao, 1);
+        gl_state.color_valid = false; // drawing from an array may leave the constant undefined
+    }
+}
+
+/* Render the VBOs handled by VAO */
+void draw3DObject (struct VAO* vao)
+{
+    bind3DObject (vao);
+
+    // Draw the geometry !
+    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+}
+
+/* 2D affine transform - translation, rotation kept as its cosine/sine, and scale.
+   Composes to the 3x2 matrix read by the shader's "M" uniform */
+struct Transform2D {
+    float x, y;
+    float cos_angle, sin_angle;
+    float scale_x, scale_y;
+};
+typedef struct Transform2D Transform2D;
+
+/* Transform that scales, then rotates by 'angle' radians, then moves to (x,y) */
+Transform2D transform2D (float x, float y, float angle=0, float scale_x=1, float scale_y=1)
+{
+    Transform2D t;
+    t.x = x;
+    t.y = y;
+    // Most sprites never rotate, so skip the trigonometry for them
+    t.cos_angle = (angle == 0) ? 1 : cos(angle);
+    t.sin_angle = (angle == 0) ? 0 : sin(angle);
+    t.scale_x = scale_x;
+    t.scale_y = scale_y;
+    return t;
+}
+
+/* Column-major 3x2 matrix of t, as glUniformMatrix3x2fv expects */
+void transform2DMatrix (const Transform2D& t, GLfloat m[6])
+{
+    m[0] = t.cos_angle*t.scale_x;  m[1] = t.sin_angle*t.scale_x;  // x axis
+    m[2] = -t.sin_angle*t.scale_y; m[3] = t.cos_angle*t.scale_y;  // y axis
+    m[4] = t.x;                    m[5] = t.y;                    // translation
+}
+
+/* Render queue - objects are submitted during the frame as commands with a sort key
+   (layer, program, fill mode, VAO) and drawn in key order by executeRenderQueue,
+   so objects sharing state are drawn back to back */
+#define MAX_RENDER_COMMANDS 1024 // the queue is flushed early if a frame submits more
+
+enum RenderLayer { LAYER_SCENE, LAYER_BRICKS }; // later layers are drawn on top
+
+struct RenderCommand {
+    ShaderProgram* program;
+    struct VAO* object;
+    GLfloat model[6]; // 3x2 model matrix, from transform2DMatrix
+    int instances; // 0 for a plain draw, else the instance count of an instanced draw
+};
+typedef struct RenderCommand RenderCommand;
+
+struct RenderQueue {
+    RenderCommand* commands; // MAX_RENDER_COMMANDS of each in the frame arena, NULL until the first submit
+    unsigned long long* keys; // sort key, command index in the low 16 bits
+    int num_commands;
+};
+typedef struct RenderQueue RenderQueue;
+RenderQueue render_queue;
+
+/* Key bits, most significant first: layer 4 | program 12 | fill mode 1 | VAO 31 | index 16 */
+unsigned long long renderKey (int layer, const ShaderProgram* program, struct VAO* vao, int index)
+{
+    return ((unsigned long long) (layer & 0xf) << 60) |
+           ((unsigned long long) (program->ID & 0xfff) << 48) |
+           ((unsigned long long) (vao->FillMode != GL_FILL) << 47) |
+           ((unsigned long long) (vao->VertexArrayID & 0x7fffffff) << 16) |
+           (unsigned long long) index;
+}
+
+/* Draw every queued command in key order and empty the queue */
+void executeRenderQueue ()
+{
+    RenderQueue& queue = render_queue;
+    sort(queue.keys, queue.keys + queue.num_commands);
+
+    for (int i=0; i<queue.num_commands; i++) {
+        RenderCommand& command = queue.commands[queue.keys[i] & 0xffff];
+        VAO* vao = command.object;
+        ShaderProgram* program = command.program;
+
+        cachedUseProgram (program->ID);
+        cachedBlend (program->Blend);
+        bind3DObject (vao);
+        glUniformMatrix3x2fv(program->MatrixID, 1, GL_FALSE, command.model);
+        if (command.instances) {
+            glUniform1i(program->InstancedID, 1);
+            glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, command.instances);
+            glUniform1i(program->InstancedID, 0);
+        }
+        else
+            glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices);
+        profileCount(COUNTER_DRAWS);
+    }
+    queue.num_commands = 0;
+}
+
+/* Drop the queue's storage along with the rest of the frame's allocations */
+void endRenderFrame ()
+{
+    render_queue.commands = NULL;
+    render_queue.keys = NULL;
+    resetArena (frame_arena);
+}
+
+/* Queue vao to be drawn with the 'model' transform by 'program' */
+void submitDraw (struct VAO* vao, const Transform2D& model, int layer, int instances=0, ShaderProgram* program=&scene_program)
+{
+    RenderQueue& queue = render_queue;
+    if (!queue.commands) {
+        queue.commands = arenaArray<RenderCommand>(frame_arena, MAX_RENDER_COMMANDS);
+        queue.keys = arenaArray<unsigned long long>(frame_arena, MAX_RENDER_COMMANDS);
+    }
+    if (queue.num_commands == MAX_RENDER_COMMANDS)
+        executeRenderQueue ();
+
+    int index = queue.num_commands++;
+    RenderCommand& command = queue.commands[index];
+    command.program = program;
+    command.object = vao;
+    transform2DMatrix(model, command.model);
+    command.instances = instances;
+    queue.keys[index] = renderKey(layer, program, vao, index);
+}
+
+/* Create the camera uniform buffer read by every program's "Camera" block */
+void initCameraBuffer ()
+{
+    glGenBuffers (1, &Matrices.CameraBuffer);
+    glBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase (GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, Matrices.CameraBuffer);
+}
+
+/* Load a program, look up its per-draw uniforms and attach it to the camera block */
+void initShaderProgram (ShaderProgram& program, const char* vertex_file_path, const char* fragment_file_path, int blend)
+{
+    program.ID = LoadShaders(vertex_file_path, fragment_file_path);
+    program.MatrixID = glGetUniformLocation(program.ID, "M");
+    program.InstancedID = glGetUniformLocation(program.ID, "instanced");
+    program.Blend = blend;
+    glUniformBlockBinding (program.ID, glGetUniformBlockIndex(program.ID, "Camera"), CAMERA_BLOCK_BINDING);
+}
+
+/* Upload this frame's view-projection matrix, shared by every draw */
+void uploadCamera (const glm::mat4& VP)
+{
+    glBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+    glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &VP[0][0]);
+}
+
+/**************************
+ * Customizable functions *
+ **************************
+ */
+struct COLOR {
+    float r;
+    float g;
+    float b;
+};
 typedef struct COLOR COLOR;
 
 struct Sprite {
     string name;
     COLOR color;
     float x,y;
+    float prev_x,prev_y; // position at the previous simulation tick, for interpolation
     VAO* object;
     int status;
     float height,width;
@@ -208,7 +1217,7 @@ struct Sprite {
     float angle; //Current Angle (Actual rotated angle of the object)
   //  int inAir;
     float radius;
-    int fixed;
+    int fixed; // 1 if it never moves, so it is drawn from the static batch
  //   float friction; //Value from 0 to 1
 //    int health;
     int isRotating;
@@ -222,15 +1231,32 @@ struct Sprite {
 typedef struct Sprite Sprite;
 long int score=0;
 bool game_over=false;
-map <string,Sprite> red_bucket;
-map <string,Sprite> green_bucket;
-map <string,Sprite>  mirror;
-map <string,Sprite> Scorecard;
-vector <Sprite>  red_brick;
-vector <Sprite>  green_brick;
-vector <Sprite>  black_brick;;
-map <string,Sprite>  laser;
-map <string,Sprite> wall;
+bool instanced_bricks=true; // draw all falling bricks with one glDrawArraysInstanced
+
+/* Scene objects - every named object is created once in initGL into its own slot
+   of 'objects' and referred to by ObjectID from then on. The names are only kept
+   to look objects up from debugging code and tools */
+enum ObjectID {
+    RED_BUCKET, GREEN_BUCKET,
+    LEFT_WALL, BOTTOM_WALL, RIGHT_WALL,
+    LASER_BASE, LASER_CANNON,
+    MIRROR1, MIRROR2, MIRROR3,
+    NUM_OBJECTS
+};
+#define FIRST_WALL LEFT_WALL
+#define LAST_WALL RIGHT_WALL
+#define FIRST_MIRROR MIRROR1
+#define LAST_MIRROR MIRROR3
+
+Sprite objects[NUM_OBJECTS];
+map <string,int> object_ids; // name -> ObjectID
+
+/* ObjectID of the object called 'name', or -1. Not for use in the frame loop */
+int findObject (const string& name)
+{
+    map<string,int>::iterator it = object_ids.find(name);
+    return it == object_ids.end() ? -1 : it->second;
+}
 float triangle_rot_dir = 1;
 float rectangle_rot_dir = 1;
 float laser_movement=0;
@@ -239,8 +1265,8 @@ float red_bucket_movement=0;
 float green_bucket_movement=0;
 bool triangle_rot_status = true;
 bool rectangle_rot_status = true;
-time_t last_fall;
-long int count=0;
+long int spawn_count=0; // bricks spawned so far, alternates the side they fall on
+unsigned long long game_seed=0; // seeds gameRandom, from --seed, a replayed log or the clock
 
 /*pair<float,float> moveObject(string name, float dx, float dy) {
     objects[name].x+=dx;
@@ -263,8 +1289,8 @@ void keyboardDown (unsigned char key, int x, int y)
          case 'S':
          case 's':
          	laser_movement+=0.1;
-         	laser["rotating"].y+=.1;
-         	laser["non-rotating"].y+=.1;
+         	objects[LASER_CANNON].y+=.1;
+         	objects[LASER_BASE].y+=.1;
          	break;
          
          case 'F':
@@ -275,8 +1301,8 @@ void keyboardDown (unsigned char key, int x, int y)
          	{
          		laser_movement=-2.1;
          	}
-         	laser["rotating"].y=laser_movement;
-         	laser["non-rotating"].y=laser_movement;
+         	objects[LASER_CANNON].y=laser_movement;
+         	objects[LASER_BASE].y=laser_movement;
          	break;
          }
       
@@ -285,18 +1311,43 @@ void keyboardDown (unsigned char key, int x, int y)
     }
 }
 
-/* Executed when a regular key is released */
-void keyboardUp (unsigned char key, int x, int y)
+/* Input queue - key events are handed from the GLUT thread to the simulation
+   thread through a single producer, single consumer ring and applied at the start
+   of the next tick */
+#define INPUT_QUEUE_SIZE 256 // a power of two
+
+struct InputEvent {
+    int key;
+    int special; // 1 for a GLUT_KEY_* special key
+    int modifiers; // glutGetModifiers() when the key was released
+};
+typedef struct InputEvent InputEvent;
+
+struct InputQueue {
+    InputEvent events[INPUT_QUEUE_SIZE];
+    std::atomic<unsigned int> head; // next event to apply, advanced by the simulation
+    std::atomic<unsigned int> tail; // next free entry, advanced by the GLUT thread
+};
+typedef struct InputQueue InputQueue;
+InputQueue input_queue;
+
+/* Queue a key release for the simulation, dropped if it is that far behind */
+void pushInput (int key, int special, int modifiers)
+{
+    unsigned int tail = input_queue.tail.load(std::memory_order_relaxed);
+    if (tail - input_queue.head.load(std::memory_order_acquire) == INPUT_QUEUE_SIZE)
+        return;
+    InputEvent& event = input_queue.events[tail % INPUT_QUEUE_SIZE];
+    event.key = key;
+    event.special = special;
+    event.modifiers = modifiers;
+    input_queue.tail.store(tail+1, std::memory_order_release);
+}
+
+/* Applied on the simulation thread when a regular key is released */
+void applyKeyUp (unsigned char key)
 {
     switch (key) {
-        case 'c':
-        case 'C':
-            rectangle_rot_status = !rectangle_rot_status;
-            break;
-        case 'p':
-        case 'P':
-            triangle_rot_status = !triangle_rot_status;
-            break;
          case 'S':
          case 's':
          {
@@ -305,8 +1356,8 @@ void keyboardUp (unsigned char key, int x, int y)
          	{
          		laser_movement=3.0;
          	}
-         	laser["rotating"].y=laser_movement;
-         	laser["non-rotating"].y=laser_movement;
+         	objects[LASER_CANNON].y=laser_movement;
+         	objects[LASER_BASE].y=laser_movement;
          	break;
          }
          case 'F':
@@ -317,8 +1368,8 @@ void keyboardUp (unsigned char key, int x, int y)
          	{
          		laser_movement=-2.1;
          	}
-         	laser["rotating"].y=laser_movement;
-         	laser["non-rotating"].y=laser_movement;
+         	objects[LASER_CANNON].y=laser_movement;
+         	objects[LASER_BASE].y=laser_movement;
          	break;
          }
          case 'A':
@@ -329,8 +1380,8 @@ void keyboardUp (unsigned char key, int x, int y)
          	{
          		laser_rotatation=-0.8;
          	}
-        // 	laser["rotating"].y=laser_movement;
-         //	laser["non-rotating"].y=laser_movement;
+        // 	objects[LASER_CANNON].y=laser_movement;
+         //	objects[LASER_BASE].y=laser_movement;
          	break;
          }
          case 'D':
@@ -341,12 +1392,10 @@ void keyboardUp (unsigned char key, int x, int y)
          	{
          		laser_rotatation=0.8;
          	}
-        // 	laser["rotating"].y=laser_movement;
-         //	laser["non-rotating"].y=laser_movement;
+        // 	objects[LASER_CANNON].y=laser_movement;
+         //	objects[LASER_BASE].y=laser_movement;
          	break;
          }
-        
-        
         case 'x':
             // do something
             break;
@@ -355,240 +1404,1296 @@ void keyboardUp (unsigned char key, int x, int y)
     }
 }
 
-/* Executed when a special key is pressed */
-void keyboardSpecialDown (int key, int x, int y)
+/* Applied on the simulation thread when a special key is released */
+void applySpecialKeyUp (int key, int modifiers)
+{
+	switch(key)
+	{
+		case GLUT_KEY_LEFT:
+		{
+			if(modifiers== GLUT_ACTIVE_CTRL)
+			{
+				red_bucket_movement-=0.2;
+				if(red_bucket_movement<-0.6)
+					red_bucket_movement=-0.6;
+			}
+			if(modifiers== GLUT_ACTIVE_SHIFT)
+			{
+				green_bucket_movement-=0.2;
+				if(green_bucket_movement<-4.6)
+					green_bucket_movement=-4.6;
+			}
+			
+			break;
+
+		}
+		case GLUT_KEY_RIGHT:
+		{
+			if(modifiers== GLUT_ACTIVE_CTRL)
+			{
+				red_bucket_movement+=0.2;
+			}
+			if(modifiers== GLUT_ACTIVE_SHIFT)
+			{
+				green_bucket_movement+=0.2;
+			}
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+/* Input log - with --record every key event applied is written out with the tick
+   it was applied on, and --replay feeds such a log back instead of live input.
+   With the same seed this replays a game exactly */
+struct InputRecord {
+    long int tick;
+    InputEvent event;
+};
+typedef struct InputRecord InputRecord;
+
+#define INPUT_LOG_RESERVE 65536 // records room is made for up front when recording
+
+struct InputLog {
+    const char* record_path; // NULL when not recording
+    bool replaying;
+    vector<InputRecord> recorded; // recorded so far
+    vector<InputRecord> replay; // loaded for replay, kept apart so recording a replay never feeds it
+    size_t next; // next record to replay
+};
+typedef struct InputLog InputLog;
+InputLog input_log = {};
+
+void applyInput (InputEvent event, long int tick)
+{
+    if (input_log.record_path) {
+        InputRecord record = { tick, event };
+        input_log.recorded.push_back(record);
+    }
+    if (event.special)
+        applySpecialKeyUp(event.key, event.modifiers);
+    else
+        applyKeyUp(event.key);
+}
+
+/* Apply every key event due on this tick, on the simulation thread */
+void drainInput (long int tick)
+{
+    unsigned int head = input_queue.head.load(std::memory_order_relaxed);
+    unsigned int tail = input_queue.tail.load(std::memory_order_acquire);
+    for (; head != tail; head++)
+        if (!input_log.replaying) // live input is ignored during a replay
+            applyInput(input_queue.events[head % INPUT_QUEUE_SIZE], tick);
+    input_queue.head.store(head, std::memory_order_release);
+
+    while (input_log.replaying && input_log.next < input_log.replay.size() &&
+           input_log.replay[input_log.next].tick <= tick)
+        applyInput(input_log.replay[input_log.next++].event, tick);
+}
+
+/* Write the recorded log: a "seed N" line, then one "tick key special modifiers"
+   line per event */
+void saveInputLog ()
+{
+    if (!input_log.record_path)
+        return;
+    ofstream out(input_log.record_path);
+    if (!out) {
+        cout << "Unable to write input log " << input_log.record_path << endl;
+        return;
+    }
+    out << "seed " << game_seed << endl;
+    for (size_t i=0; i<input_log.recorded.size(); i++) {
+        const InputRecord& record = input_log.recorded[i];
+        out << record.tick << " " << record.event.key << " " << record.event.special << " " << record.event.modifiers << endl;
+    }
+}
+
+/* Load a log written by saveInputLog for replay, and take over its seed */
+void loadInputLog (const char* path)
+{
+    ifstream in(path);
+    string word;
+    if (!in || !(in >> word >> game_seed) || word != "seed") {
+        cout << "Unable to read input log " << path << endl;
+        exit(1);
+    }
+    InputRecord record;
+    while (in >> record.tick >> record.event.key >> record.event.special >> record.event.modifiers)
+        input_log.replay.push_back(record);
+    input_log.replaying = true;
+    input_log.next = 0;
+}
+
+/* Executed when a regular key is released */
+void keyboardUp (unsigned char key, int x, int y)
+{
+    // Render settings change here, game input goes to the simulation
+    switch (key) {
+        case 'c':
+        case 'C':
+            rectangle_rot_status = !rectangle_rot_status;
+            break;
+        case 'p':
+        case 'P':
+            triangle_rot_status = !triangle_rot_status;
+            break;
+        case 'i':
+        case 'I':
+            instanced_bricks = !instanced_bricks;
+            break;
+        default:
+            pushInput(key, 0, 0);
+            break;
+    }
+}
+
+/* Executed when a special key is pressed */
+void keyboardSpecialDown (int key, int x, int y)
+{
+}
+
+/* Executed when a special k ey is released */
+void keyboardSpecialUp (int key, int x, int y)
+{
+	pushInput(key, 1, glutGetModifiers());
+}
+
+/* Executed when a mouse button 'button' is put into state 'state'
+ at screen position ('x', 'y')
+ */
+void mouseClick (int button, int state, int x, int y)
+{
+    switch (button) {
+        case GLUT_LEFT_BUTTON:
+            if (state == GLUT_UP)
+                triangle_rot_dir *= -1;
+            break;
+        case GLUT_RIGHT_BUTTON:
+            if (state == GLUT_UP) {
+                rectangle_rot_dir *= -1;
+            }
+            break;
+
+
+        default:
+            break;
+    }
+}
+
+/* Executed when the mouse moves to position ('x', 'y') */
+void mouseMotion (int x, int y)
+{
+}
+
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (int width, int height)
+{
+	GLfloat fov = 90.0f;
+
+	// sets the viewport of openGL renderer
+	glViewport (0, 0, (GLsizei) width, (GLsizei) height);
+
+	// set the projection matrix as perspective/ortho
+	// Store the projection matrix in a variable for future use
+
+    // Perspective projection for 3D views
+    // Matrices.projection = glm::perspective (fov, (GLfloat) width / (GLfloat) height, 0.1f, 500.0f);
+
+    // Ortho projection for 2D views
+    Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
+}
+
+VAO *triangle, *rectangle, * line;
+
+/* Line batch - drawline appends colored segments, drawLines submits all of them
+   as a single GL_LINES draw from the streaming buffer */
+#define MAX_LINE_VERTICES 1024
+
+struct LineBatch {
+    struct VAO* object;
+    Vertex2D vertices[MAX_LINE_VERTICES];
+    int num_vertices;
+};
+typedef struct LineBatch LineBatch;
+LineBatch lines;
+
+/* Point the line VAO at this frame's vertices in the streaming buffer */
+void setLineAttributes (GLintptr offset)
+{
+    cachedBindVertexArray (lines.object->VertexArrayID);
+    cachedBindArrayBuffer (stream.Buffer);
+    glVertexAttribPointer(
+                          0,                  // attribute 0. Vertices
+                          2,                  // size (x,y), z reads as 0
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          sizeof(Vertex2D),   // stride
+                          (void*)offset       // array buffer offset
+                          );
+    glVertexAttribPointer(
+                          1,                  // attribute 1. Color
+                          4,                  // size (r,g,b,a)
+                          GL_UNSIGNED_BYTE,   // type
+                          GL_TRUE,            // normalized?
+                          sizeof(Vertex2D),   // stride
+                          (void*)(offset + 2*sizeof(GLfloat)) // array buffer offset
+                          );
+}
+
+void initLineBatch ()
+{
+    // Same layout as create2DObject, but the vertices live in the streaming buffer
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = GL_LINES;
+    vao->NumVertices = 0;
+    vao->FillMode = GL_FILL;
+    vao->EnabledArrays = 0;
+    vao->VertexBuffer = stream.Buffer;
+    vao->ColorBuffer = 0;
+    vao->FlatColor = 0;
+    glGenVertexArrays(1, &(vao->VertexArrayID));
+
+    lines.object = vao;
+    lines.num_vertices = 0;
+    setLineAttributes (0);
+}
+
+/* Queue a segment from (x1,y1) to (x2,y2), drawn by the next drawLines */
+void drawline(double x1,double y1,double x2,double y2,COLOR A)
+{
+    if (lines.num_vertices + 2 > MAX_LINE_VERTICES)
+        return;
+    Vertex2D* v = &lines.vertices[lines.num_vertices];
+    v[0].x = x1; v[0].y = y1;
+    v[1].x = x2; v[1].y = y2;
+    v[0].r = v[1].r = colorByte(A.r);
+    v[0].g = v[1].g = colorByte(A.g);
+    v[0].b = v[1].b = colorByte(A.b);
+    v[0].a = v[1].a = 255;
+    lines.num_vertices += 2;
+}
+
+void drawLines ()
+{
+    if (lines.num_vertices == 0)
+        return;
+
+    GLintptr offset = streamData(lines.vertices, lines.num_vertices*sizeof(Vertex2D), sizeof(Vertex2D));
+    if (offset >= 0) {
+        setLineAttributes (offset);
+        lines.object->NumVertices = lines.num_vertices;
+        submitDraw (lines.object, transform2D(0, 0), LAYER_SCENE);
+    }
+    lines.num_vertices = 0;
+}
+
+/* Unit circle tables - cos/sin of every step around the circle for each supported
+   segment count, filled once by initUnitCircles. Round shapes are then built by
+   scaling and offsetting a table, with no trig per vertex */
+#define NUM_UNIT_CIRCLES 4
+#define MAX_CIRCLE_SEGMENTS 64
+const int unit_circle_segments[NUM_UNIT_CIRCLES] = { 8, 16, 32, MAX_CIRCLE_SEGMENTS };
+GLfloat unit_circles[NUM_UNIT_CIRCLES][2*(MAX_CIRCLE_SEGMENTS+1)]; // x,y of segments+1 points, the last equal to the first
+
+void initUnitCircles ()
+{
+    for (int c=0; c<NUM_UNIT_CIRCLES; c++) {
+        int segments = unit_circle_segments[c];
+        GLfloat* table = unit_circles[c];
+        for (int i=0; i<segments; i++) {
+            double angle = 2*M_PI*i/segments;
+            table[2*i] = cos(angle);
+            table[2*i + 1] = sin(angle);
+        }
+        table[2*segments] = table[0]; // closes the loop without wrapping indices
+        table[2*segments + 1] = table[1];
+    }
+}
+
+/* Table for 'segments' steps, or NULL if that count is not one of unit_circle_segments */
+const GLfloat* unitCircle (int segments)
+{
+    for (int c=0; c<NUM_UNIT_CIRCLES; c++)
+        if (unit_circle_segments[c] == segments)
+            return unit_circles[c];
+    return NULL;
+}
+
+/* Queue the outline of 'count' steps of a 'segments' step circle, starting at step
+   'first' (0 is the +x axis, counter clockwise); count == segments draws a ring */
+void drawArc (float x, float y, float radius, int segments, int first, int count, COLOR colour)
+{
+    const GLfloat* unit = unitCircle(segments);
+    if (!unit)
+        return;
+    for (int i=first; i<first+count; i++) {
+        int a = i % segments, b = a+1;
+        drawline(x + radius*unit[2*a], y + radius*unit[2*a + 1],
+                 x + radius*unit[2*b], y + radius*unit[2*b + 1], colour);
+    }
+}
+
+void createTriangle ()
+{
+  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+
+  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
+  static const GLfloat vertex_buffer_data [] = {
+    0, 1,0, // vertex 0
+    -1,-1,0, // vertex 1
+    1,-1,0, // vertex 2
+  };
+
+  static const GLfloat color_buffer_data [] = {
+    1,0,0, // color 0
+    0,1,0, // color 1
+    0,0,1, // color 2
+  };
+
+  // create3DObject creates and returns a handle to a VAO that can be used later
+  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+}
+bool sameColor (COLOR a, COLOR b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+/* Create a width x height quad centred on the origin, one color per corner */
+VAO* createQuad (COLOR colorA, COLOR colorB, COLOR colorC, COLOR colorD, float height, float width)
+{
+    // GL3 accepts only Triangles. Quads are not supported
+    float w=width/2,h=height/2;
+    GLfloat vertex_buffer_data [] = {
+        -w,-h,0, // vertex 1
+        -w,h,0, // vertex 2
+        w,h,0, // vertex 3
+
+        w,h,0, // vertex 3
+        w,-h,0, // vertex 4
+        -w,-h,0  // vertex 1
+    };
+
+    GLfloat color_buffer_data [] = {
+        colorA.r,colorA.g,colorA.b, // color 1
+        colorB.r,colorB.g,colorB.b, // color 2
+        colorC.r,colorC.g,colorC.b, // color 3
+
+        colorC.r,colorC.g,colorC.b, // color 4
+        colorD.r,colorD.g,colorD.b, // color 5
+        colorA.r,colorA.g,colorA.b // color 6
+    };
+
+    // A single color needs no color buffer at all
+    if (sameColor(colorA, colorB) && sameColor(colorA, colorC) && sameColor(colorA, colorD))
+        return create2DObject(GL_TRIANGLES, 6, vertex_buffer_data, colorA.r, colorA.g, colorA.b, GL_FILL);
+
+    // create2DObject creates and returns a handle to a VAO that can be used later
+    return create2DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
+}
+
+void createRectangle (int id, string name, COLOR colorA, COLOR colorB, COLOR colorC, COLOR colorD, float x, float y, float height, float width)
+{
+    VAO *rectangle = createQuad(colorA, colorB, colorC, colorD, height, width);
+    Sprite vishsprite = {};
+    vishsprite.color = colorA;
+    vishsprite.name = name;
+    vishsprite.object = rectangle;
+    vishsprite.x=x;
+    vishsprite.y=y;
+    vishsprite.height=height;
+    vishsprite.width=width;
+    vishsprite.status=1;
+    //vishsprite.inAir=0;
+    vishsprite.x_speed=0;
+    vishsprite.y_speed=0;
+    vishsprite.fixed=0;
+    vishsprite.radius=(sqrt(height*height+width*width))/2;
+    objects[id]=vishsprite;
+    object_ids[name]=id;
+}
+
+/* Static batch - every sprite marked 'fixed' is baked into one buffer of world space
+   triangles and drawn with a single call, instead of one draw and model matrix each.
+   Fixed sprites are flat colored rectangles; call bakeStaticBatch again whenever one
+   is added, moved or removed */
+struct StaticBatch {
+    struct VAO* mesh; // NULL until the first bake
+};
+typedef struct StaticBatch StaticBatch;
+StaticBatch static_batch;
+
+void bakeStaticBatch ()
+{
+    vector<GLfloat> positions, colors;
+    for (int id=0; id<NUM_OBJECTS; id++) {
+        const Sprite& sprite = objects[id];
+        if (!sprite.fixed)
+            continue;
+        // The two triangles of createQuad, rotated and moved into place
+        float w = sprite.width/2, h = sprite.height/2;
+        float corners[6][2] = { {-w,-h}, {-w,h}, {w,h}, {w,h}, {w,-h}, {-w,-h} };
+        float cos_a = cos(sprite.angle), sin_a = sin(sprite.angle);
+        for (int v=0; v<6; v++) {
+            positions.push_back(sprite.x + corners[v][0]*cos_a - corners[v][1]*sin_a);
+            positions.push_back(sprite.y + corners[v][0]*sin_a + corners[v][1]*cos_a);
+            positions.push_back(0);
+            colors.push_back(sprite.color.r);
+            colors.push_back(sprite.color.g);
+            colors.push_back(sprite.color.b);
+        }
+    }
+
+    int num_vertices = positions.size()/3;
+    if (!static_batch.mesh)
+        static_batch.mesh = create2DObject(GL_TRIANGLES, num_vertices, positions.data(), colors.data(), GL_FILL);
+    else
+        fill2DObject(static_batch.mesh, num_vertices, positions.data(), colors.data());
+}
+
+void drawStaticBatch ()
+{
+    if (static_batch.mesh && static_batch.mesh->NumVertices > 0)
+        submitDraw(static_batch.mesh, transform2D(0, 0), LAYER_SCENE);
+}
+
+/* Circle batch - round objects are a single quad each, drawn by the circle program
+   which evaluates the circle's signed distance per fragment. drawCircle queues one
+   instance, drawCircles draws all of them in one instanced call */
+#define MAX_CIRCLES 4096
+#define CIRCLE_INSTANCE_FLOATS 6 // centre x,y, radius, r,g,b
+
+struct CircleBatch {
+    struct VAO* quad; // -1..1 in x and y, scaled by each instance's radius
+    GLfloat instance_data[MAX_CIRCLES*CIRCLE_INSTANCE_FLOATS];
+    int num_instances;
+};
+typedef struct CircleBatch CircleBatch;
+CircleBatch circles;
+
+/* Point the circle instance attributes at this frame's instances in the streaming buffer */
+void setCircleAttributes (GLintptr offset)
+{
+    cachedBindVertexArray (circles.quad->VertexArrayID);
+    cachedBindArrayBuffer (stream.Buffer);
+    glVertexAttribPointer(
+                          2,                  // attribute 2. Instance centre and radius
+                          3,                  // size (x,y,radius)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          CIRCLE_INSTANCE_FLOATS*sizeof(GLfloat), // stride
+                          (void*)offset       // array buffer offset
+                          );
+    glVertexAttribPointer(
+                          3,                  // attribute 3. Instance color
+                          3,                  // size (r,g,b)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          CIRCLE_INSTANCE_FLOATS*sizeof(GLfloat), // stride
+                          (void*)(offset + 3*sizeof(GLfloat)) // array buffer offset
+                          );
+}
+
+void initCircleBatch ()
+{
+    COLOR white = {1.0, 1.0, 1.0};
+    circles.quad = createQuad(white, white, white, white, 2.0, 2.0);
+    circles.num_instances = 0;
+
+    setCircleAttributes (0);
+    glVertexAttribDivisor (2, 1); // advance once per circle, not per vertex
+    glVertexAttribDivisor (3, 1);
+    cachedEnableVertexAttribArray (circles.quad, 2);
+    cachedEnableVertexAttribArray (circles.quad, 3);
+}
+
+/* Queue a filled circle, drawn by the next drawCircles */
+void drawCircle (float x, float y, float radius, COLOR colour)
+{
+    if (circles.num_instances == MAX_CIRCLES)
+        return;
+    GLfloat* instance = &circles.instance_data[CIRCLE_INSTANCE_FLOATS*circles.num_instances++];
+    instance[0] = x;
+    instance[1] = y;
+    instance[2] = radius;
+    instance[3] = colour.r;
+    instance[4] = colour.g;
+    instance[5] = colour.b;
+}
+
+void drawCircles ()
+{
+    if (circles.num_instances == 0)
+        return;
+
+    GLsizeiptr stride = CIRCLE_INSTANCE_FLOATS*sizeof(GLfloat);
+    GLintptr offset = streamData(circles.instance_data, circles.num_instances*stride, stride);
+    if (offset >= 0) {
+        setCircleAttributes (offset);
+        submitDraw (circles.quad, transform2D(0, 0), LAYER_SCENE, circles.num_instances, &circle_program);
+    }
+    circles.num_instances = 0;
+}
+
+/* Brick store - all falling bricks of one color share a single quad mesh, and the
+   bricks themselves are kept as separate arrays per field so the falling, collision
+   and drawing loops each read only what they need from contiguous memory.
+   Live bricks are packed at indices 0..count-1: removing one moves the last brick
+   into its place. Handles name a brick for its whole life, whatever its index */
+#define MAX_BRICKS 16384 // sized for 10k+ bricks; collision, laser and snapshot limits scale from it
+#define BRICK_SIZE 0.2f
+
+enum BrickColour { RED_BRICK, GREEN_BRICK, BLACK_BRICK, NUM_BRICK_COLOURS };
+
+COLOR brick_palette[NUM_BRICK_COLOURS] = {
+    {1.0, 0.0, 0.0}, // RED_BRICK
+    {0.0, 1.0, 0.0}, // GREEN_BRICK
+    {0.0, 0.0, 0.0}, // BLACK_BRICK
+};
+
+#define BRICK_INSTANCE_FLOATS 5 // x, y offset + r, g, b color
+
+struct BrickStore {
+    VAO* mesh[NUM_BRICK_COLOURS]; // shared quad, created once in initGL
+    VAO* instanced_mesh; // white quad + per-instance offset/color attributes
+    GLfloat instance_data[BRICK_INSTANCE_FLOATS*MAX_BRICKS];
+    int num_instances; // bricks queued for the next drawBrickInstances
+
+    // Per brick, by index
+    float x[MAX_BRICKS], y[MAX_BRICKS];
+    float prev_x[MAX_BRICKS], prev_y[MAX_BRICKS]; // position at the previous tick, for interpolation
+    float speed_x[MAX_BRICKS], speed_y[MAX_BRICKS]; // units per second
+    float width[MAX_BRICKS], height[MAX_BRICKS];
+    int colour[MAX_BRICKS];
+    int handle[MAX_BRICKS];
+    int count;
+
+    // Per handle
+    int handle_index[MAX_BRICKS]; // index of the brick, -1 while the handle is free
+    int free_handle[MAX_BRICKS]; // stack of unused handles
+    int num_free_handles;
+    long int dropped; // spawns refused because the store was full
+};
+typedef struct BrickStore BrickStore;
+BrickStore bricks;
+
+/* Point the brick instance attributes at this frame's instances in the streaming buffer */
+void setBrickAttributes (GLintptr offset)
+{
+    cachedBindVertexArray (bricks.instanced_mesh->VertexArrayID);
+    cachedBindArrayBuffer (stream.Buffer);
+    glVertexAttribPointer(
+                          2,                  // attribute 2. Instance offset
+                          2,                  // size (x,y)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          BRICK_INSTANCE_FLOATS*sizeof(GLfloat), // stride
+                          (void*)offset       // array buffer offset
+                          );
+    glVertexAttribPointer(
+                          3,                  // attribute 3. Instance color
+                          3,                  // size (r,g,b)
+                          GL_FLOAT,           // type
+                          GL_FALSE,           // normalized?
+                          BRICK_INSTANCE_FLOATS*sizeof(GLfloat), // stride
+                          (void*)(offset + 2*sizeof(GLfloat)) // array buffer offset
+                          );
+}
+
+/* Create the shared brick meshes and empty the store */
+void initBrickStore ()
+{
+    for (int c=0; c<NUM_BRICK_COLOURS; c++) {
+        COLOR col = brick_palette[c];
+        bricks.mesh[c] = createQuad(col, col, col, col, BRICK_SIZE, BRICK_SIZE);
+    }
+
+    // The instanced quad takes its color from attribute 3, so the mesh itself is white
+    COLOR white = {1.0, 1.0, 1.0};
+    bricks.instanced_mesh = createQuad(white, white, white, white, BRICK_SIZE, BRICK_SIZE);
+    bricks.num_instances = 0;
+
+    setBrickAttributes (0);
+    glVertexAttribDivisor (2, 1); // advance once per brick, not per vertex
+    glVertexAttribDivisor (3, 1);
+    cachedEnableVertexAttribArray (bricks.instanced_mesh, 2);
+    cachedEnableVertexAttribArray (bricks.instanced_mesh, 3);
+
+    for (int h=0; h<MAX_BRICKS; h++) {
+        bricks.handle_index[h] = -1;
+        bricks.free_handle[h] = MAX_BRICKS-1-h; // lowest handle is popped first
+    }
+    bricks.num_free_handles = MAX_BRICKS;
+    bricks.count = 0;
+}
+
+/* Add a brick falling from (x,y), returns its handle or -1 if the store is full */
+int spawnBrick (int colour, float x, float y, float speed_y)
+{
+    if (bricks.num_free_handles == 0) {
+        if (bricks.dropped++ == 0)
+            cout << "Warning: Brick store is full (" << MAX_BRICKS << " bricks), dropping new bricks" << endl;
+        return -1;
+    }
+
+    int handle = bricks.free_handle[--bricks.num_free_handles];
+    int index = bricks.count++;
+    bricks.handle_index[handle] = index;
+    bricks.handle[index] = handle;
+
+    bricks.x[index] = bricks.prev_x[index] = x;
+    bricks.y[index] = bricks.prev_y[index] = y;
+    bricks.speed_x[index] = 0;
+    bricks.speed_y[index] = speed_y;
+    bricks.width[index] = BRICK_SIZE;
+    bricks.height[index] = BRICK_SIZE;
+    bricks.colour[index] = colour;
+    return handle;
+}
+
+/* Queue a brick at (x,y) for the next instanced draw */
+void queueBrickInstance (int colour, float x, float y)
+{
+    GLfloat* instance = &bricks.instance_data[BRICK_INSTANCE_FLOATS*bricks.num_instances++];
+    instance[0] = x;
+    instance[1] = y;
+    instance[2] = brick_palette[colour].r;
+    instance[3] = brick_palette[colour].g;
+    instance[4] = brick_palette[colour].b;
+}
+
+/* Upload the queued bricks and submit all of them as one instanced draw, offsets are in world space */
+void drawBrickInstances ()
+{
+    if (bricks.num_instances == 0)
+        return;
+
+    GLsizeiptr stride = BRICK_INSTANCE_FLOATS*sizeof(GLfloat);
+    GLintptr offset = streamData(bricks.instance_data, bricks.num_instances*stride, stride);
+    if (offset >= 0) {
+        setBrickAttributes (offset);
+        submitDraw (bricks.instanced_mesh, transform2D(0, 0), LAYER_BRICKS, bricks.num_instances);
+    }
+    bricks.num_instances = 0;
+}
+
+/* Remove a brick by handle, moving the last brick into its index */
+void removeBrick (int handle)
+{
+    int index = bricks.handle_index[handle];
+    int last = --bricks.count;
+    if (index != last) {
+        bricks.x[index] = bricks.x[last];
+        bricks.y[index] = bricks.y[last];
+        bricks.prev_x[index] = bricks.prev_x[last];
+        bricks.prev_y[index] = bricks.prev_y[last];
+        bricks.speed_x[index] = bricks.speed_x[last];
+        bricks.speed_y[index] = bricks.speed_y[last];
+        bricks.width[index] = bricks.width[last];
+        bricks.height[index] = bricks.height[last];
+        bricks.colour[index] = bricks.colour[last];
+        bricks.handle[index] = bricks.handle[last];
+        bricks.handle_index[bricks.handle[index]] = index;
+    }
+    bricks.handle_index[handle] = -1;
+    bricks.free_handle[bricks.num_free_handles++] = handle;
+}
+
+
+/* Collision grid - every tick bricks, buckets, walls and mirrors are inserted into a
+   uniform grid over the glm::ortho(-4,4,-4,4) playfield, and only objects sharing a
+   cell are tested against each other. The per-tick arrays live in the tick arena */
+#define GRID_MIN -4.0f
+#define GRID_CELL_SIZE 0.5f
+#define GRID_COLUMNS 16
+#define GRID_ROWS 16
+#define GRID_CELLS (GRID_COLUMNS*GRID_ROWS)
+#define MAX_COLLIDERS (MAX_BRICKS + 16)
+#define MAX_GRID_ENTRIES (4*MAX_COLLIDERS + 4*GRID_CELLS) // bricks cover at most 4 cells, walls span the grid
+#define MAX_COLLISION_PAIRS (4*MAX_BRICKS)
+
+enum ColliderKind { COLLIDER_BRICK, COLLIDER_BUCKET, COLLIDER_WALL, COLLIDER_MIRROR };
+
+struct Collider {
+    float min_x, min_y, max_x, max_y; // axis aligned bounds
+    int kind;
+    int index; // brick handle, or for buckets the brick colour they catch
+    int first_column, last_column, first_row, last_row; // cells covered, clamped to the grid
+};
+typedef struct Collider Collider;
+
+struct CollisionPair {
+    int a, b; // collider indices, a is always the brick
+};
+typedef struct CollisionPair CollisionPair;
+
+struct CollisionGrid {
+    Collider* colliders; // MAX_COLLIDERS
+    int num_colliders;
+    int cell_start[GRID_CELLS+1]; // entries of cell c are cell_entries[cell_start[c] .. cell_start[c+1]-1]
+    int* cell_entries; // MAX_GRID_ENTRIES
+    CollisionPair* pairs; // MAX_COLLISION_PAIRS
+    int num_pairs;
+};
+typedef struct CollisionGrid CollisionGrid;
+CollisionGrid collision;
+
+/* Start this tick's grid with empty arrays from the tick arena */
+void beginCollisionGrid ()
+{
+    collision.colliders = arenaArray<Collider>(tick_arena, MAX_COLLIDERS);
+    collision.cell_entries = arenaArray<int>(tick_arena, MAX_GRID_ENTRIES);
+    collision.pairs = arenaArray<CollisionPair>(tick_arena, MAX_COLLISION_PAIRS);
+    collision.num_colliders = 0;
+    collision.num_pairs = 0;
+}
+
+int gridColumn (float x)
+{
+    int column = (int) floor((x - GRID_MIN)/GRID_CELL_SIZE);
+    return column < 0 ? 0 : (column >= GRID_COLUMNS ? GRID_COLUMNS-1 : column);
+}
+
+int gridRow (float y)
+{
+    int row = (int) floor((y - GRID_MIN)/GRID_CELL_SIZE);
+    return row < 0 ? 0 : (row >= GRID_ROWS ? GRID_ROWS-1 : row);
+}
+
+/* Add an axis aligned box to this tick's colliders */
+void addCollider (float x, float y, float half_w, float half_h, int kind, int index)
+{
+    if (collision.num_colliders == MAX_COLLIDERS)
+        return;
+    Collider& c = collision.colliders[collision.num_colliders++];
+    c.min_x = x - half_w;
+    c.max_x = x + half_w;
+    c.min_y = y - half_h;
+    c.max_y = y + half_h;
+    c.kind = kind;
+    c.index = index;
+    c.first_column = gridColumn(c.min_x);
+    c.last_column = gridColumn(c.max_x);
+    c.first_row = gridRow(c.min_y);
+    c.last_row = gridRow(c.max_y);
+}
+
+/* Add a (possibly rotated) sprite by the bounds of its rectangle */
+void addCollider (const Sprite& sprite, int kind, int index)
 {
+    float cos_a = fabs(cos(sprite.angle)), sin_a = fabs(sin(sprite.angle));
+    float half_w = (cos_a*sprite.width + sin_a*sprite.height)/2;
+    float half_h = (sin_a*sprite.width + cos_a*sprite.height)/2;
+    addCollider(sprite.x, sprite.y, half_w, half_h, kind, index);
 }
 
-/* Executed when a special k ey is released */
-void keyboardSpecialUp (int key, int x, int y)
+/* Bucket the colliders into cells with a counting sort, so the grid never allocates */
+void buildCollisionGrid ()
 {
-	switch(key)
-	{
-		case GLUT_KEY_LEFT:
-		{
-			if(glutGetModifiers()== GLUT_ACTIVE_CTRL)
-			{
-				red_bucket_movement-=0.2;
-				if(red_bucket_movement<-0.6)
-					red_bucket_movement=-0.6;
-			}
-			if(glutGetModifiers()== GLUT_ACTIVE_SHIFT)
-			{
-				green_bucket_movement-=0.2;
-				if(green_bucket_movement<-4.6)
-					green_bucket_movement=-4.6;
-			}
-			
-			break;
-
-		}
-		case GLUT_KEY_RIGHT:
-		{
-			if(glutGetModifiers()== GLUT_ACTIVE_CTRL)
-			{
-				red_bucket_movement+=0.2;
-			}
-			if(glutGetModifiers()== GLUT_ACTIVE_SHIFT)
-			{
-				green_bucket_movement+=0.2;
-			}
-			break;
-		}
-		default:
-			break;
-	}
+    int* start = collision.cell_start;
+    for (int cell=0; cell<=GRID_CELLS; cell++)
+        start[cell] = 0;
+
+    // Count entries per cell, shifted by one so the prefix sum yields start offsets
+    for (int i=0; i<collision.num_colliders; i++) {
+        Collider& c = collision.colliders[i];
+        for (int row=c.first_row; row<=c.last_row; row++)
+            for (int column=c.first_column; column<=c.last_column; column++)
+                start[row*GRID_COLUMNS + column + 1]++;
+    }
+    for (int cell=0; cell<GRID_CELLS; cell++)
+        start[cell+1] += start[cell];
+
+    int fill[GRID_CELLS];
+    for (int cell=0; cell<GRID_CELLS; cell++)
+        fill[cell] = start[cell];
+    for (int i=0; i<collision.num_colliders; i++) {
+        Collider& c = collision.colliders[i];
+        for (int row=c.first_row; row<=c.last_row; row++)
+            for (int column=c.first_column; column<=c.last_column; column++) {
+                int cell = row*GRID_COLUMNS + column;
+                if (fill[cell] < MAX_GRID_ENTRIES)
+                    collision.cell_entries[fill[cell]++] = i;
+            }
+    }
 }
 
-/* Executed when a mouse button 'button' is put into state 'state'
- at screen position ('x', 'y')
- */
-void mouseClick (int button, int state, int x, int y)
+/* Find every overlapping brick/non-brick pair; each pair is reported by one cell only */
+void findCollisionPairs ()
 {
-    switch (button) {
-        case GLUT_LEFT_BUTTON:
-            if (state == GLUT_UP)
-                triangle_rot_dir *= -1;
-            break;
-        case GLUT_RIGHT_BUTTON:
-            if (state == GLUT_UP) {
-                rectangle_rot_dir *= -1;
+    collision.num_pairs = 0;
+    for (int cell=0; cell<GRID_CELLS; cell++) {
+        int first = collision.cell_start[cell], last = min(collision.cell_start[cell+1], MAX_GRID_ENTRIES);
+        for (int i=first; i<last; i++) {
+            for (int j=i+1; j<last; j++) {
+                int a = collision.cell_entries[i], b = collision.cell_entries[j];
+                Collider* ca = &collision.colliders[a];
+                Collider* cb = &collision.colliders[b];
+                // Bricks never interact with each other, and static objects never move
+                if ((ca->kind == COLLIDER_BRICK) == (cb->kind == COLLIDER_BRICK))
+                    continue;
+                if (cb->kind == COLLIDER_BRICK) {
+                    swap(a, b);
+                    swap(ca, cb);
+                }
+                if (ca->max_x < cb->min_x || cb->max_x < ca->min_x ||
+                    ca->max_y < cb->min_y || cb->max_y < ca->min_y)
+                    continue;
+
+                // Both share every cell of their overlap, report it only from the lowest one
+                int column = max(ca->first_column, cb->first_column);
+                int row = max(ca->first_row, cb->first_row);
+                if (row*GRID_COLUMNS + column != cell || collision.num_pairs == MAX_COLLISION_PAIRS)
+                    continue;
+                collision.pairs[collision.num_pairs].a = a;
+                collision.pairs[collision.num_pairs].b = b;
+                collision.num_pairs++;
             }
-            break;
+        }
+    }
+}
 
+/* Laser - beams are traced from the cannon as rays against every wall, mirror,
+   bucket and brick edge, reflecting off mirrors until they hit something else */
+#define MAX_LASER_SEGMENTS (4*MAX_BRICKS + 64)
+#define MAX_LASER_BOUNCES 8
+#define MAX_LASER_BEAMS 16
+#define MAX_LASER_LINES (MAX_LASER_BEAMS*(MAX_LASER_BOUNCES+1))
+#define LASER_RANGE 16.0f // longer than the playfield diagonal
+#define LASER_EPSILON 1e-4f // keeps a reflected ray from hitting the mirror it left
+
+enum SegmentKind { SEGMENT_WALL, SEGMENT_MIRROR, SEGMENT_BUCKET, SEGMENT_BRICK };
+
+/* Kept as separate arrays so castRay walks contiguous floats and the compiler
+   can vectorize its intersection loop */
+struct SegmentStore {
+    GLfloat x[MAX_LASER_SEGMENTS], y[MAX_LASER_SEGMENTS];   // start point
+    GLfloat dx[MAX_LASER_SEGMENTS], dy[MAX_LASER_SEGMENTS]; // start to end
+    GLfloat t[MAX_LASER_SEGMENTS]; // scratch, ray distance to each segment
+    int kind[MAX_LASER_SEGMENTS];
+    int index[MAX_LASER_SEGMENTS]; // brick handle for bricks
+    int num_segments;
+    int num_static; // walls and mirrors come first and are kept between ticks
+};
+typedef struct SegmentStore SegmentStore;
+SegmentStore segments;
 
-        default:
-            break;
-    }
+struct LaserLine {
+    GLfloat x0, y0, x1, y1;
+};
+typedef struct LaserLine LaserLine;
+
+/* Beams traced this tick, as the line segments draw() renders */
+struct LaserBeams {
+    LaserLine lines[MAX_LASER_LINES];
+    int num_lines;
+};
+typedef struct LaserBeams LaserBeams;
+LaserBeams laser_beams;
+
+void addSegment (float x0, float y0, float x1, float y1, int kind, int index)
+{
+    if (segments.num_segments == MAX_LASER_SEGMENTS)
+        return;
+    int i = segments.num_segments++;
+    segments.x[i] = x0;
+    segments.y[i] = y0;
+    segments.dx[i] = x1-x0;
+    segments.dy[i] = y1-y0;
+    segments.kind[i] = kind;
+    segments.index[i] = index;
 }
 
-/* Executed when the mouse moves to position ('x', 'y') */
-void mouseMotion (int x, int y)
+/* Add the four edges of a (possibly rotated) sprite */
+void addSpriteSegments (const Sprite& sprite, int kind, int index)
 {
+    float c = cos(sprite.angle), s = sin(sprite.angle);
+    float wx = c*sprite.width/2, wy = s*sprite.width/2;    // half width axis
+    float hx = -s*sprite.height/2, hy = c*sprite.height/2; // half height axis
+    float px[4] = { sprite.x-wx-hx, sprite.x+wx-hx, sprite.x+wx+hx, sprite.x-wx+hx };
+    float py[4] = { sprite.y-wy-hy, sprite.y+wy-hy, sprite.y+wy+hy, sprite.y-wy+hy };
+    for (int i=0; i<4; i++)
+        addSegment(px[i], py[i], px[(i+1)%4], py[(i+1)%4], kind, index);
 }
 
+/* Add the four edges of an axis aligned box */
+void addBoxSegments (float x, float y, float half_w, float half_h, int kind, int index)
+{
+    addSegment(x-half_w, y-half_h, x+half_w, y-half_h, kind, index);
+    addSegment(x+half_w, y-half_h, x+half_w, y+half_h, kind, index);
+    addSegment(x+half_w, y+half_h, x-half_w, y+half_h, kind, index);
+    addSegment(x-half_w, y+half_h, x-half_w, y-half_h, kind, index);
+}
 
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (int width, int height)
+/* Walls and mirrors do not move, so their segments are built once after initGL
+   creates them */
+void initLaserSegments ()
 {
-	GLfloat fov = 90.0f;
+    segments.num_segments = 0;
+    for (int id=FIRST_WALL; id<=LAST_WALL; id++)
+        addSpriteSegments(objects[id], SEGMENT_WALL, -1);
+    addSegment(-4.0f, 4.0f, 4.0f, 4.0f, SEGMENT_WALL, -1); // open top of the playfield
+
+    // Mirrors are thin enough to reflect along their centre line, from either side
+    for (int id=FIRST_MIRROR; id<=LAST_MIRROR; id++) {
+        const Sprite& m = objects[id];
+        float wx = cos(m.angle)*m.width/2, wy = sin(m.angle)*m.width/2;
+        addSegment(m.x-wx, m.y-wy, m.x+wx, m.y+wy, SEGMENT_MIRROR, -1);
+    }
+    segments.num_static = segments.num_segments;
+}
 
-	// sets the viewport of openGL renderer
-	glViewport (0, 0, (GLsizei) width, (GLsizei) height);
+/* Returns the segment first hit by the ray (ox,oy) + t*(dx,dy), and its t, or -1 */
+int castRay (float ox, float oy, float dx, float dy, float* hit_t)
+{
+    int n = segments.num_segments;
+    const GLfloat* __restrict sx = segments.x;
+    const GLfloat* __restrict sy = segments.y;
+    const GLfloat* __restrict sdx = segments.dx;
+    const GLfloat* __restrict sdy = segments.dy;
+    GLfloat* __restrict st = segments.t;
+
+    // Every segment is tested the same way, so this loop vectorizes
+    for (int i=0; i<n; i++) {
+        float px = sx[i]-ox, py = sy[i]-oy;
+        float denom = dx*sdy[i] - dy*sdx[i]; // zero when parallel
+        float t = (px*sdy[i] - py*sdx[i])/denom;
+        float u = (px*dy - py*dx)/denom; // position along the segment, 0..1
+        bool hit = (denom != 0) & (t > LASER_EPSILON) & (u >= 0) & (u <= 1); // & rather than && keeps it branch free
+        st[i] = hit ? t : FLT_MAX;
+    }
 
-	// set the projection matrix as perspective/ortho
-	// Store the projection matrix in a variable for future use
+    int hit = -1;
+    float nearest = FLT_MAX;
+    for (int i=0; i<n; i++) {
+        if (st[i] < nearest) {
+            nearest = st[i];
+            hit = i;
+        }
+    }
+    *hit_t = nearest;
+    return hit;
+}
 
-    // Perspective projection for 3D views
-    // Matrices.projection = glm::perspective (fov, (GLfloat) width / (GLfloat) height, 0.1f, 500.0f);
+/* Trace one beam into laser_beams, returns the segment it stopped on or -1 */
+int traceBeam (float ox, float oy, float angle)
+{
+    float dx = cos(angle), dy = sin(angle);
+    for (int bounce=0; bounce<=MAX_LASER_BOUNCES; bounce++) {
+        float t;
+        int hit = castRay(ox, oy, dx, dy, &t);
+        if (hit < 0)
+            t = LASER_RANGE;
+
+        if (laser_beams.num_lines < MAX_LASER_LINES) {
+            LaserLine& line = laser_beams.lines[laser_beams.num_lines++];
+            line.x0 = ox;
+            line.y0 = oy;
+            line.x1 = ox + t*dx;
+            line.y1 = oy + t*dy;
+        }
+        if (hit < 0 || segments.kind[hit] != SEGMENT_MIRROR)
+            return hit;
+
+        // Reflect about the mirror normal: d - 2(d.n)n
+        float nx = -segments.dy[hit], ny = segments.dx[hit];
+        float k = 2*(dx*nx + dy*ny)/(nx*nx + ny*ny);
+        ox += t*dx;
+        oy += t*dy;
+        dx -= k*nx;
+        dy -= k*ny;
+    }
+    return -1; // out of bounces
+}
 
-    // Ortho projection for 2D views
-    Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
+/* Rebuild the moving segments and retrace every beam for this tick */
+void updateLaser ()
+{
+    segments.num_segments = segments.num_static;
+    addSpriteSegments(objects[RED_BUCKET], SEGMENT_BUCKET, RED_BRICK);
+    addSpriteSegments(objects[GREEN_BUCKET], SEGMENT_BUCKET, GREEN_BRICK);
+    for (int i=0; i<bricks.count; i++)
+        addBoxSegments(bricks.x[i], bricks.y[i], bricks.width[i]/2, bricks.height[i]/2, SEGMENT_BRICK, bricks.handle[i]);
+
+    // Beams leave from the muzzle of the rotating barrel
+    laser_beams.num_lines = 0;
+    const Sprite& cannon = objects[LASER_CANNON];
+    traceBeam(cannon.x + cos(cannon.angle)*cannon.width/2, cannon.y + sin(cannon.angle)*cannon.width/2, cannon.angle);
 }
 
-VAO *triangle, *rectangle, * line,* fireball;
+/* Fixed timestep simulation - game state only changes in steps of TICK_SECONDS,
+   however often frames are drawn, and draw() interpolates between the last two ticks */
+#define TICK_RATE 60
+#define TICK_SECONDS (1.0/TICK_RATE)
+#define MAX_FRAME_SECONDS 0.25 // after a long stall drop time instead of running hundreds of ticks
+#define BRICK_FALL_SPEED 0.6f // units per second
+#define BRICK_SPAWN_TICKS TICK_RATE // time() has 1s resolution, so the old 0.5s check spawned once a second
+
+struct Simulation {
+    double accumulator; // real time not yet consumed by a tick
+    double last_time; // when advanceSimulation was last called
+    long int tick;
+    long int last_spawn_tick;
+    unsigned long long random; // gameRandom state, only advanced by ticks
+};
+typedef struct Simulation Simulation;
+Simulation sim;
 
-// Creates the  object used in this sample code
-void drawline(double x1,double y1,double x2,double y2,COLOR A)
+/* The game's only source of randomness (splitmix64), so a seed and an input log
+   reproduce a game exactly on any machine */
+unsigned int gameRandom ()
 {
-	static const GLfloat vertex_buffer_data [] = {
-    x1, y1,0, // vertex 0
-    x2, y2,0, // vertex 1
-  };
-  static const GLfloat color_buffer_data [] = {
-    A.r, A.g,A.b, // color 0
-    A.r,A.g,A.b, // color 1
-  };
+    unsigned long long z = (sim.random += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return (unsigned int) ((z ^ (z >> 31)) >> 32);
+}
 
+int max_render_fps = 0; // 0 draws as often as GLUT calls idle
+double last_frame_time = 0; // when idle last drew, for the frame cap
 
+/* Move the player controlled sprites to where the input has put them */
+void placeControlledSprites ()
+{
+    objects[RED_BUCKET].x=-2.0f+red_bucket_movement;
+    objects[RED_BUCKET].y=-3.3f;
+    objects[GREEN_BUCKET].x=2.0f+green_bucket_movement;
+    objects[GREEN_BUCKET].y=-3.3f;
+    objects[LASER_BASE].x=-3.78f;
+    objects[LASER_BASE].y=laser_movement;
+    objects[LASER_CANNON].x=-3.64f;
+    objects[LASER_CANNON].y=laser_movement;
+    objects[LASER_CANNON].angle=laser_rotatation*M_PI/2;
 }
-void createTriangle ()
+
+/* Advance the game by exactly one tick: spawn, move and collide bricks */
+void updateGame ()
 {
-  /* ONLY vertices between the bounds specified in glm::ortho will be visible on screen */
+    drainInput(sim.tick);
+    placeControlledSprites();
+
+    profileBegin (PROFILE_SPAWN);
+    if (sim.tick - sim.last_spawn_tick >= BRICK_SPAWN_TICKS) {
+        double position=gameRandom()%20;
+        long int colour=gameRandom()%3;
+        spawn_count++;
+        if (spawn_count%2==1)
+            position=-position/10 -0.7;
+        else
+            position=position/10 +0.7;
+        spawnBrick(colour,position,4.0,-BRICK_FALL_SPEED);
+        sim.last_spawn_tick = sim.tick;
+    }
+    profileEnd (PROFILE_SPAWN);
+
+    profileBegin (PROFILE_COLLISION);
+    int count = bricks.count;
+    for (int i=0; i<count; i++) {
+        bricks.prev_x[i] = bricks.x[i];
+        bricks.prev_y[i] = bricks.y[i];
+        bricks.x[i] += bricks.speed_x[i]*TICK_SECONDS;
+        bricks.y[i] += bricks.speed_y[i]*TICK_SECONDS;
+    }
 
-  /* Define vertex array as used in glBegin (GL_TRIANGLES) */
-  static const GLfloat vertex_buffer_data [] = {
-    0, 1,0, // vertex 0
-    -1,-1,0, // vertex 1
-    1,-1,0, // vertex 2
-  };
+    // A black brick reaching the top of the buckets ends the game, caught or not
+    float catch_line = objects[RED_BUCKET].y + objects[RED_BUCKET].height/2;
+    for (int i=bricks.count-1; i>=0; i--) {
+        if (bricks.colour[i]==BLACK_BRICK && bricks.y[i]-bricks.height[i]/2 <= catch_line) {
+            game_over=true;
+            removeBrick(bricks.handle[i]);
+        }
+    }
 
-  static const GLfloat color_buffer_data [] = {
-    1,0,0, // color 0
-    0,1,0, // color 1
-    0,0,1, // color 2
-  };
+    beginCollisionGrid();
+    count = bricks.count;
+    for (int i=0; i<count; i++)
+        addCollider(bricks.x[i], bricks.y[i], bricks.width[i]/2, bricks.height[i]/2, COLLIDER_BRICK, bricks.handle[i]);
+    addCollider(objects[RED_BUCKET], COLLIDER_BUCKET, RED_BRICK);
+    addCollider(objects[GREEN_BUCKET], COLLIDER_BUCKET, GREEN_BRICK);
+    for (int id=FIRST_WALL; id<=LAST_WALL; id++)
+        addCollider(objects[id], COLLIDER_WALL, 0);
+    for (int id=FIRST_MIRROR; id<=LAST_MIRROR; id++)
+        addCollider(objects[id], COLLIDER_MIRROR, 0);
+
+    buildCollisionGrid();
+    findCollisionPairs();
+
+    for (int p=0; p<collision.num_pairs; p++) {
+        int handle = collision.colliders[collision.pairs[p].a].index;
+        Collider& other = collision.colliders[collision.pairs[p].b];
+        int i = bricks.handle_index[handle];
+        if (i < 0)
+            continue; // already caught through another pair this tick
+
+        if (other.kind == COLLIDER_BUCKET) {
+            if (bricks.colour[i]==other.index)
+                score+=10;
+            removeBrick(handle);
+        }
+        else if (other.kind == COLLIDER_WALL)
+            removeBrick(handle); // missed, fell to the floor
+    }
+    profileEnd (PROFILE_COLLISION);
 
-  // create3DObject creates and returns a handle to a VAO that can be used later
-  triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_LINE);
+    profileBegin (PROFILE_LASER);
+    updateLaser();
+    profileEnd (PROFILE_LASER);
+
+    resetArena (tick_arena);
+    sim.tick++;
 }
-void create_fireball(float a, float b ,float radius1)
-{
 
-	int i,j;
-	// GLfloat x1= 0;//4.0f*cos(final_increments*5*DEGTORAD);
-	//GLfloat y1= 0;// 4.0f*sin(final_increments*5*DEGTORAD);
-	//GLfloat radius1=0.3;
-	//GLfloat PI=3.14f;
-	double triangleAmount = 20;
-	int triangle = 20; //# of triangles used to draw circle
-	//  cout<<"Draw circle";
+/* Game snapshots - after every tick the simulation copies everything draw() needs
+   into a snapshot and publishes it through a triple buffer. The simulation always
+   owns one slot to write, the renderer one to read, and the third holds the latest
+   published snapshot; either side swaps with it atomically and never waits */
+#define SNAPSHOT_FRESH 4 // set in 'latest' until the renderer has taken that snapshot
 
-	//GLfloat radius = 0.8f; //radius
-	float twicePi = 2.0* M_PI;
+struct Pose {
+    float x, y, angle;
+};
+typedef struct Pose Pose;
 
-	//glBegin(GL_TRIANGLE_FAN);
-	//glVertex2f(x, y); // center of circle
-	GLfloat vertex_buffer_data[500];
-	GLfloat color_buffer_data [500];
-	for(i = 0,j=0; i <= 3*triangle;i++) //a and b are circle corrdinates
-	{
-		vertex_buffer_data[j++]= a + (radius1 * cos((i *  twicePi) / triangleAmount)); 
-		vertex_buffer_data[j++]=b + (radius1 * sin((i * twicePi) / triangleAmount));
-		vertex_buffer_data[j++]=0; 
-		vertex_buffer_data[j++]= a + (radius1 * cos(((i+1) *  twicePi) / triangleAmount)); 
-		vertex_buffer_data[j++]=a + (radius1 * sin(((i+1) * twicePi) / triangleAmount));
-		vertex_buffer_data[j++]=0;
-		vertex_buffer_data[j++]=a;
-		vertex_buffer_data[j++]=b;
-		vertex_buffer_data[j++]=0;
-	}
-	for(i = 0; i <= 9*triangle;i++) 
-		color_buffer_data[i]=0.0;
+struct SnapshotBrick {
+    float prev_x, prev_y, x, y; // positions at the last two ticks, for interpolation
+    int colour;
+};
+typedef struct SnapshotBrick SnapshotBrick;
+
+struct GameSnapshot {
+    double time; // monotonicTime() when it was published
+    long int tick;
+    long int score;
+    bool game_over;
+    Pose red_bucket, green_bucket, laser_base, laser_cannon;
+    SnapshotBrick bricks[MAX_BRICKS];
+    int num_bricks;
+    LaserBeams beams;
+};
+typedef struct GameSnapshot GameSnapshot;
+
+struct SnapshotBuffer {
+    GameSnapshot slot[3];
+    int back; // written by the simulation
+    std::atomic<int> latest; // slot index, with SNAPSHOT_FRESH while unread
+    int front; // read by the renderer
+};
+typedef struct SnapshotBuffer SnapshotBuffer;
+SnapshotBuffer snapshots;
 
-	fireball = create3DObject(GL_TRIANGLES,60,vertex_buffer_data,color_buffer_data,GL_FILL);
+Pose spritePose (const Sprite& sprite)
+{
+    Pose pose = { sprite.x, sprite.y, sprite.angle };
+    return pose;
 }
-void createRectangle (string name, COLOR colorA, COLOR colorB, COLOR colorC, COLOR colorD, float x, float y, float height, float width, string component)
+
+/* Copy the game state into the back slot and make it the latest snapshot */
+void publishSnapshot ()
 {
-    // GL3 accepts only Triangles. Quads are not supported
-    float w=width/2,h=height/2;
-    GLfloat vertex_buffer_data [] = {
-        -w,-h,0, // vertex 1
-        -w,h,0, // vertex 2
-        w,h,0, // vertex 3
+    GameSnapshot& snap = snapshots.slot[snapshots.back];
+    snap.tick = sim.tick;
+    snap.score = score;
+    snap.game_over = game_over;
+    snap.red_bucket = spritePose(objects[RED_BUCKET]);
+    snap.green_bucket = spritePose(objects[GREEN_BUCKET]);
+    snap.laser_base = spritePose(objects[LASER_BASE]);
+    snap.laser_cannon = spritePose(objects[LASER_CANNON]);
+
+    snap.num_bricks = bricks.count;
+    for (int i=0; i<bricks.count; i++) {
+        SnapshotBrick& copy = snap.bricks[i];
+        copy.prev_x = bricks.prev_x[i];
+        copy.prev_y = bricks.prev_y[i];
+        copy.x = bricks.x[i];
+        copy.y = bricks.y[i];
+        copy.colour = bricks.colour[i];
+    }
 
-        w,h,0, // vertex 3
-        w,-h,0, // vertex 4
-        -w,-h,0  // vertex 1
-    };
+    snap.beams.num_lines = laser_beams.num_lines;
+    memcpy (snap.beams.lines, laser_beams.lines, laser_beams.num_lines*sizeof(LaserLine));
 
-    GLfloat color_buffer_data [] = {
-        colorA.r,colorA.g,colorA.b, // color 1
-        colorB.r,colorB.g,colorB.b, // color 2
-        colorC.r,colorC.g,colorC.b, // color 3
+    snap.time = monotonicTime();
+    snapshots.back = snapshots.latest.exchange(snapshots.back | SNAPSHOT_FRESH, std::memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+}
 
-        colorC.r,colorC.g,colorC.b, // color 4
-        colorD.r,colorD.g,colorD.b, // color 5
-        colorA.r,colorA.g,colorA.b // color 6
-    };
+/* The newest published snapshot, valid until the next call */
+const GameSnapshot& latestSnapshot ()
+{
+    if (snapshots.latest.load(std::memory_order_relaxed) & SNAPSHOT_FRESH)
+        snapshots.front = snapshots.latest.exchange(snapshots.front, std::memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+    return snapshots.slot[snapshots.front];
+}
 
-    // create3DObject creates and returns a handle to a VAO that can be used later
-    VAO *rectangle = create3DObject(GL_TRIANGLES, 6, vertex_buffer_data, color_buffer_data, GL_FILL);
-    Sprite vishsprite = {};
-    vishsprite.color = colorA;
-    vishsprite.name = name;
-    vishsprite.object = rectangle;
-    vishsprite.x=x;
-    vishsprite.y=y;
-    vishsprite.height=height;
-    vishsprite.width=width;
-    vishsprite.status=1;
-    //vishsprite.inAir=0;
-    vishsprite.x_speed=0;
-    vishsprite.y_speed=0;
-    vishsprite.fixed=0;
-    vishsprite.radius=(sqrt(height*height+width*width))/2;
-    if(component=="green_bucket")
-    {
-    	green_bucket[name]=vishsprite;
-    }
-    if(component=="red_bucket")
-    {
-    	red_bucket[name]=vishsprite;
-    }
-    if(component=="wall")
-    {
-    	wall[name]=vishsprite;
-    }
-    if(component=="red_brick")
-    {
-    	red_brick.push_back(vishsprite);
-    }
-    if(component=="green_brick")
-    {
-    	green_brick.push_back(vishsprite);
+/* Publish the initial state, so the first frame has something to draw */
+void initSnapshots ()
+{
+    snapshots.back = 0;
+    snapshots.latest.store(1);
+    snapshots.front = 2;
+    placeControlledSprites();
+    publishSnapshot();
+}
+
+/* Consume 'seconds' of elapsed time in whole ticks, keeping the remainder for next time */
+void advanceSimulation (double seconds)
+{
+    if (seconds > MAX_FRAME_SECONDS)
+        seconds = MAX_FRAME_SECONDS;
+
+    sim.accumulator += seconds;
+    while (sim.accumulator >= TICK_SECONDS && !game_over) {
+        updateGame ();
+        publishSnapshot ();
+        sim.accumulator -= TICK_SECONDS;
     }
-    if(component=="black_brick")
-    {
-    	black_brick.push_back(vishsprite);
+    if (game_over)
+        sim.accumulator = 0; // the game has stopped, don't bank time for ticks that never run
+}
+
+/* Simulation thread - the windowed game ticks here, off the GL thread, so a slow
+   swap does not hold up the game and input stays responsive */
+std::atomic<bool> sim_running(false);
+std::thread* sim_thread = NULL;
+
+void simulationLoop ()
+{
+    while (sim_running.load()) {
+        double now = monotonicTime();
+        profileBegin (PROFILE_SIMULATION);
+        advanceSimulation (now - sim.last_time);
+        profileEnd (PROFILE_SIMULATION);
+        profileTickEnd ();
+        sim.last_time = now;
+
+        // Sleep until the next tick is due, at most one tick so stopSimulationThread never waits long
+        double wait = TICK_SECONDS - sim.accumulator;
+        if (wait < 0)
+            wait = 0;
+        if (wait > TICK_SECONDS)
+            wait = TICK_SECONDS;
+        usleep((useconds_t) (1e6*wait));
     }
-    if(component=="laser")
-    	laser[name]=vishsprite;
-    if(component=="mirror")
-    	mirror[name]=vishsprite;
 }
 
+void startSimulationThread ()
+{
+    sim.last_time = monotonicTime();
+    sim_running.store(true);
+    sim_thread = new std::thread(simulationLoop);
+}
+
+void stopSimulationThread ()
+{
+    if (!sim_thread)
+        return;
+    sim_running.store(false);
+    sim_thread->join();
+    delete sim_thread;
+    sim_thread = NULL;
+}
 
 float camera_rotation_angle = 90;
 float rectangle_rotation = 0;
@@ -596,7 +2701,9 @@ float triangle_rotation = 0;
 float rectangle_tranlation=0;
 /* Render the scene with openGL */
 /* Edit this function according to your assignment */
-void draw ()
+/* 'interpolate' places moving objects between the last two ticks by the clock; without
+   it they are drawn exactly at the previous tick, so a headless frame is reproducible */
+void draw (bool interpolate)
 {
   // clear the color and depth in the frame buffer
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -605,7 +2712,14 @@ void draw ()
   // Don't change unless you know what you are doing
  // if(game_over==true)
   //	return;
-  glUseProgram (programID);
+  cachedUseProgram (scene_program.ID);
+  beginStreamFrame ();
+
+  // Draw the latest tick, interpolated by how far the next one is due
+  const GameSnapshot& snap = latestSnapshot();
+  float alpha = 0;
+  if (interpolate)
+      alpha = min((monotonicTime() - snap.time) / TICK_SECONDS, 1.0);
   
 //  
 
@@ -615,14 +2729,6 @@ void draw ()
   glm::vec3 target (0, 0, 0);
   // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
   glm::vec3 up (0, 1, 0);
-   GLfloat lineVertices[]=
-   {
-   	 200,100,0,
-   	 100,300,0
-   };
-   glVertexPointer(3,GL_FLOAT,0,lineVertices);
-   glDrawArrays(GL_LINES,0,2);
-   glDisableClientState(GL_VERTEX_ARRAY);
   // Compute Camera matrix (view)
   // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
   //  Don't change unless you are sure!!
@@ -632,278 +2738,100 @@ void draw ()
   //  Don't change unless you are sure!!
   glm::mat4 VP = Matrices.projection * Matrices.view;
 
-  // Send our transformation to the currently bound shader, in the "MVP" uniform
-  // For each model you render, since the MVP will be different (at least the M part)
+  // Send it once per frame to the "Camera" uniform block, the shader multiplies it with each model matrix
   //  Don't change unless you are sure!!
-  glm::mat4 MVP;	// MVP = Projection * View * Model
-
-  // Load identity to model matrix
-  Matrices.model = glm::mat4(1.0f);
+  uploadCamera (VP);
 
   /* Render your scene */
 
-  glm::mat4 translateTriangle = glm::translate (glm::vec3(0.0f, 0.0f, 0.0f)); // glTranslatef
-  glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1));  // rotate about vector (1,0,0)
-  glm::mat4 triangleTransform = translateTriangle * rotateTriangle;
-  Matrices.model *= triangleTransform; 
-  MVP = VP * Matrices.model; // MVP = p * V * M
-  
-  //  Don't change unless you are sure!!
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-draw3DObject(fireball);
-  // draw3DObject draws the VAO given to it using current MVP matrix
+  // submitDraw queues the VAO given to it to be drawn with this 2D model transform
+  COLOR fireball_colour = {0.0, 0.0, 0.0};
+  drawCircle(0.0f, 0.0f, 0.06f, fireball_colour);
 
  { 
-  Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(-2.0f+red_bucket_movement,-3.3f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  red_bucket["red_bucket"].x=-2.0f+red_bucket_movement;
-  red_bucket["red_bucket"].y=-3.3f;
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(red_bucket["red_bucket"].object);
- // cout << red_bucket["red_bucket"].x<<endl;
+  submitDraw(objects[RED_BUCKET].object, transform2D(snap.red_bucket.x, snap.red_bucket.y, rectangle_rotation*M_PI/180.0f), LAYER_SCENE);
+ // cout << objects[RED_BUCKET].x<<endl;
 }
 {
-  Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(2.0f+green_bucket_movement,-3.3f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-  // draw3DObject draws the VAO given to it using current MVP matrix
-  draw3DObject(green_bucket["green_bucket"].object);
-  green_bucket["green_bucket"].x=2.0f+green_bucket_movement;
-  green_bucket["green_bucket"].y=-3.3f;
+  submitDraw(objects[GREEN_BUCKET].object, transform2D(snap.green_bucket.x, snap.green_bucket.y, rectangle_rotation*M_PI/180.0f), LAYER_SCENE);
   // Swap the frame buffers
  }
- {
- 	Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(-3.98f,0.0f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(0.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(wall["left_wall"].object);
-  wall["left_wall"].x=-3.98f;
-  wall["left_wall"].y=0.0f;
- }
- {
- 	Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(3.98f,0.0f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(0.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(wall["right_wall"].object);
-  wall["right_wall"].x=3.98f;
-  wall["right_wall"].y=0.0f;
- }
- {
- 	Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(0.0f,-3.9f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(0.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(wall["bottom_wall"].object);
-  wall["bottom_wall"].x=0.0f;
-  wall["bottom_wall"].y=-3.9f;
-}
-{
-	Matrices.model = glm::mat4(1.0f);
-
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(-3.78f, laser_movement, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(0.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(laser["non-rotating"].object);
-  laser["non-rotating"].x=-3.78;
-  laser["non-rotating"].y=laser_movement;
-}
-{
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(-3.64f,laser_movement, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(laser_rotatation*M_PI/2), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(laser["rotating"].object);
-  laser["rotating"].x=-3.64;
-  laser["rotating"].y=laser_movement;
-  laser["rotating"].angle=laser_rotatation*M_PI/2;
-}
-{
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(0.0f,-1.8f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(M_PI/4), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(mirror["mirror1"].object);
-  mirror["mirror1"].x=0.0f;
-  mirror["mirror1"].y=-1.8f;
-  mirror["mirror1"].angle=M_PI/4;
-
-}
-{
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(0.0f,2.2f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(-M_PI/4), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(mirror["mirror2"].object);
-  mirror["mirror2"].x=0.0f;
-  mirror["mirror2"].y=-2.2f;
-  mirror["mirror2"].angle=-M_PI/4;
-}
-{
-  Matrices.model = glm::mat4(1.0f);
-  glm::mat4 translateRectangle = glm::translate (glm::vec3(3.5f,0.0f, 0.0f));        // glTranslatef
-  glm::mat4 rotateRectangle = glm::rotate((float)(M_PI/2), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  Matrices.model *= (translateRectangle * rotateRectangle);
-  MVP = VP * Matrices.model;
-  glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  draw3DObject(mirror["mirror3"].object);
-  mirror["mirror3"].x=3.5f;
-  mirror["mirror3"].y=0.0f;
-  mirror["mirror3"].angle=0;
-}
-time_t now;
-time(&now);
-if(difftime(now,last_fall)>0.5)
-{
-	double position=rand()%20;
-	long int colour=rand()%3+1;
-	string brick_name;
-
-	COLOR col;
-	if(colour==1)
-	{
-		col.r=1.0;
-		col.b=0.0;
-		col.g=0.0;
-		brick_name="red_brick";
-	}
-	if(colour==2)
-	{
-		col.r=0.0;
-		col.b=0.0;
-		col.g=1.0;
-		brick_name="green_brick";
-			
-	}
-	if(colour==3)
-	{
-		col.r=0.0;
-		col.b=0.0;
-		col.g=0.0;
-		brick_name="black_brick";
-	}
-	count++;
-	if(count%2==1)
+  // Walls and mirrors
+  drawStaticBatch();
+{
+  submitDraw(objects[LASER_BASE].object, transform2D(snap.laser_base.x, snap.laser_base.y), LAYER_SCENE);
+}
+{
+  submitDraw(objects[LASER_CANNON].object, transform2D(snap.laser_cannon.x, snap.laser_cannon.y, snap.laser_cannon.angle), LAYER_SCENE);
+}
+for(int i=0;i<snap.num_bricks;i++)
+{
+	const SnapshotBrick& brick=snap.bricks[i];
+	// Bricks move between ticks, so draw them where they are between the last two states
+	float x=brick.prev_x+(brick.x-brick.prev_x)*alpha;
+	float y=brick.prev_y+(brick.y-brick.prev_y)*alpha;
+	if(instanced_bricks)
 	{
-		position=-position/10 -0.7;
+		queueBrickInstance(brick.colour,x,y);
 	}
 	else
 	{
-		
-		position/=10;
-		position+=0.7;
-		
+		submitDraw(bricks.mesh[brick.colour], transform2D(x, y), LAYER_BRICKS);
 	}
-	createRectangle("brick",col,col,col,col,position,4.0,0.2,0.2,brick_name);
-	time(&last_fall);
-}
-for(vector<Sprite> :: iterator it=red_brick.begin();it!=red_brick.end();++it)
-{
-	Sprite temp=*it;
- 	Matrices.model = glm::mat4(1.0f);
-  	glm::mat4 translateRectangle = glm::translate (glm::vec3(temp.x,temp.y, 0.0f));        // glTranslatef
-  	glm::mat4 rotateRectangle = glm::rotate((float)(0.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  	Matrices.model *= (translateRectangle * rotateRectangle);
-  	MVP = VP * Matrices.model;
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  	draw3DObject(temp.object);	
-  	(*it).y=(*it).y-0.01;
-  	temp=*it;
-  	if(temp.y-red_bucket["red_bucket"].y<=(temp.height+red_bucket["red_bucket"].height)/2)
-  	{
-  		
-  		if(fabs(temp.x-red_bucket["red_bucket"].x)<=(temp.width+red_bucket["red_bucket"].width)/2)
-  		{
-  			score+=10;
-  		}
-  		
-  		red_brick.erase(it);
-   	}
-}
-for(vector<Sprite> :: iterator it=black_brick.begin();it!=black_brick.end();++it)
-{
-	Sprite temp=*it;
- 	Matrices.model = glm::mat4(1.0f);
-  	glm::mat4 translateRectangle = glm::translate (glm::vec3(temp.x,temp.y, 0.0f));        // glTranslatef
-  	glm::mat4 rotateRectangle = glm::rotate((float)(0.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  	Matrices.model *= (translateRectangle * rotateRectangle);
-  	MVP = VP * Matrices.model;
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  	draw3DObject(temp.object);	
-  	(*it).y=(*it).y-0.01;
-  	temp=*it;
-  	if(temp.y-red_bucket["red_bucket"].y<=(temp.height+red_bucket["red_bucket"].height)/2)
-  	{
-  		black_brick.erase(it);
-  		game_over=true;
-
-   	}
-}
-for(vector<Sprite> :: iterator it=green_brick.begin();it!=green_brick.end();++it)
-{
-	Sprite temp=*it;
- 	Matrices.model = glm::mat4(1.0f);
-  	glm::mat4 translateRectangle = glm::translate (glm::vec3(temp.x,temp.y, 0.0f));        // glTranslatef
-  	glm::mat4 rotateRectangle = glm::rotate((float)(0.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
-  	Matrices.model *= (translateRectangle * rotateRectangle);
-  	MVP = VP * Matrices.model;
-  	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-  	draw3DObject(temp.object);	
-  	(*it).y=(*it).y-0.01;
-  	temp=*it;
-  	if(temp.y-green_bucket["green_bucket"].y<=(temp.height+green_bucket["green_bucket"].height)/2)
-  	{
-  		
-  		if(fabs(temp.x-red_bucket["green_bucket"].x)<=(temp.width+red_bucket["green_bucket"].width)/2)
-  		{
-  			score+=10;
-  		}
-  		green_brick.erase(it);
-   	}
-}	
-  glutSwapBuffers ();
+}
+drawBrickInstances();
+
+// Laser beams as traced on the last simulation tick
+COLOR beam_colour = {1.0, 0.0, 0.0};
+for(int i=0;i<snap.beams.num_lines;i++)
+{
+	const LaserLine& beam=snap.beams.lines[i];
+	drawline(beam.x0, beam.y0, beam.x1, beam.y1, beam_colour);
+}
+drawLines();
+drawCircles();
+executeRenderQueue();
+endStreamFrame();
+endRenderFrame();
+}
+
+/* Draw a frame and present it in the GLUT window */
+void display ()
+{
+    profileBegin (PROFILE_DRAW);
+    profileGPUBegin ();
+    draw (true);
+    profileGPUEnd ();
+    profileEnd (PROFILE_DRAW);
+
+    profileBegin (PROFILE_SWAP);
+    glutSwapBuffers ();
+    profileEnd (PROFILE_SWAP);
+    profileFrameEnd ();
 }
 
 /* Executed when the program is idle (no I/O activity) */
 void idle () {
     // OpenGL should never stop drawing
     // can draw the same scene or a modified scene
-    if(game_over==true)
+    const GameSnapshot& snap = latestSnapshot();
+    if(snap.game_over==true)
     {
-    	cout << "Score is:" << score<<endl;
+    	cout << "Score is:" << snap.score<<endl;
     	exit(0);
 
     }	
-    draw (); // drawing same scene
+
+    // The game itself advances on the simulation thread
+    double now = monotonicTime();
+    if (max_render_fps > 0 && now - last_frame_time < 1.0/max_render_fps) {
+        // Frame cap: sleep off the rest of the frame instead of spinning
+        usleep((useconds_t) (1e6*(1.0/max_render_fps - (now - last_frame_time))));
+        return;
+    }
+    last_frame_time = now;
+
+    display (); // drawing same scene
 }
 
 
@@ -941,12 +2869,137 @@ void initGLUT (int& argc, char** argv, int width, int height)
 
     glutReshapeFunc (reshapeWindow);
 
-    glutDisplayFunc (draw); // function to draw when active
+    glutDisplayFunc (display); // function to draw when active
     glutIdleFunc (idle); // function to draw when idle (no I/O activity)
     
     glutIgnoreKeyRepeat (true); // Ignore keys held down
 }
 
+/* Headless mode - render into an offscreen framebuffer on an EGL surfaceless
+   context (e.g. Mesa llvmpipe), so the game runs without a display or GPU */
+struct Headless {
+    EGLDisplay display;
+    EGLContext context;
+    GLuint FramebufferID;
+    GLuint ColorBuffer;
+    GLuint DepthBuffer;
+};
+typedef struct Headless Headless;
+Headless headless;
+
+/* Create a GL 3.3 core context without any window and bind an offscreen framebuffer */
+void initHeadless (int width, int height)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    headless.display = EGL_NO_DISPLAY;
+    if (getPlatformDisplay)
+        headless.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (headless.display == EGL_NO_DISPLAY)
+        headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if (headless.display == EGL_NO_DISPLAY || !eglInitialize(headless.display, NULL, NULL)) {
+        cout << "Error: Failed to initialise EGL" << endl;
+        exit (1);
+    }
+
+    static const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, // the default (window) is never offered offscreen
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    eglBindAPI(EGL_OPENGL_API);
+    eglChooseConfig(headless.display, config_attribs, &config, 1, &num_configs);
+
+    static const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3, // Init GL 3.3
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.context = EGL_NO_CONTEXT;
+    if (num_configs > 0)
+        headless.context = eglCreateContext(headless.display, config, EGL_NO_CONTEXT, context_attribs);
+    if (headless.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.context)) {
+        cout << "Error: Failed to create a surfaceless GL 3.3 context" << endl;
+        exit (1);
+    }
+
+    // Initialize GLEW, Needed in Core profile
+    // There is no GLX display here, which GLEW reports only after loading the GL entry points
+    glewExperimental = GL_TRUE;
+    GLenum err = glewInit();
+    if (err != GLEW_OK && err != GLEW_ERROR_NO_GLX_DISPLAY) {
+        cout << "Error: Failed to initialise GLEW : "<< glewGetErrorString(err) << endl;
+        exit (1);
+    }
+
+    // Offscreen color + depth targets replace the window's default framebuffer
+    glGenFramebuffers (1, &headless.FramebufferID);
+    glGenRenderbuffers (1, &headless.ColorBuffer);
+    glGenRenderbuffers (1, &headless.DepthBuffer);
+
+    glBindRenderbuffer (GL_RENDERBUFFER, headless.ColorBuffer);
+    glRenderbufferStorage (GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer (GL_RENDERBUFFER, headless.DepthBuffer);
+    glRenderbufferStorage (GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glBindFramebuffer (GL_FRAMEBUFFER, headless.FramebufferID);
+    glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.ColorBuffer);
+    glFramebufferRenderbuffer (GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.DepthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        cout << "Error: Offscreen framebuffer is incomplete" << endl;
+        exit (1);
+    }
+}
+
+/* Simulate and draw 'frames' frames offscreen, waiting for each to finish, and print timing stats */
+void runHeadless (long int frames)
+{
+    double total = 0, fastest = 0, slowest = 0;
+    for (long int i=0; i<frames; i++) {
+        double start = monotonicTime();
+        // Simulated time advances one tick per frame, independent of how long frames take
+        profileBegin (PROFILE_SIMULATION);
+        advanceSimulation (TICK_SECONDS);
+        profileEnd (PROFILE_SIMULATION);
+
+        profileBegin (PROFILE_DRAW);
+        profileGPUBegin ();
+        draw (false); // the tick just ran, so the clock must not move bricks
+        profileGPUEnd ();
+        profileEnd (PROFILE_DRAW);
+
+        profileBegin (PROFILE_SWAP);
+        glFinish (); // no swap to wait on, so wait for the GPU instead
+        profileEnd (PROFILE_SWAP);
+        profileFrameEnd ();
+        double elapsed = monotonicTime() - start;
+
+        total += elapsed;
+        if (i == 0 || elapsed < fastest)
+            fastest = elapsed;
+        if (elapsed > slowest)
+            slowest = elapsed;
+    }
+
+    cout << "Headless frames: " << frames << endl;
+    if (frames > 0) {
+        cout << "Frame time (ms): avg " << 1000*total/frames
+             << " min " << 1000*fastest << " max " << 1000*slowest << endl;
+        cout << "FPS: " << frames/total << endl;
+    }
+    cout << "Bricks spawned: " << spawn_count << endl;
+    cout << "Score is:" << score << endl;
+
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headless.display, headless.context);
+    eglTerminate(headless.display);
+}
+
 /* Process menu option 'op' */
 void menu(int op)
 {
@@ -982,11 +3035,11 @@ void initGL (int width, int height)
 	
     
 	// Create and compile our GLSL program from the shaders
-	programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-	// Get a handle for our "MVP" uniform
-	Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
-	srand (time(NULL));
-	time(&last_fall);
+	initShaderProgram(scene_program, "Sample_GL.vert", "Sample_GL.frag", 0);
+	initShaderProgram(circle_program, "Circle_GL.vert", "Circle_GL.frag", 1);
+	initCameraBuffer();
+	initProfiler();
+	sim.random = game_seed;
 
 
 	reshapeWindow (width, height);
@@ -994,36 +3047,51 @@ void initGL (int width, int height)
 	// Background color of the scene
 	glClearColor (1.0f, 1.0f, 1.0f, 1.0f); // R, G, B, A
 	glClearDepth (1.0f);
-	create_fireball(0.0,0.0,0.06);
+	initStreamBuffer();
+	initBrickStore();
+	initLineBatch();
+	initCircleBatch();
+	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // enabled only for programs with Blend set
 	glEnable (GL_DEPTH_TEST);
 	glDepthFunc (GL_LEQUAL);
 	COLOR As;
 	As.r=1.0;
 	As.g=0;
 	As.b=0;
-	createRectangle("red_bucket",As,As,As,As,0,0,1.00,0.75,"red_bucket");
+	createRectangle(RED_BUCKET,"red_bucket",As,As,As,As,0,0,1.00,0.75);
     As.r=0;
 	As.g=0.5;
 	As.b=0;
-	createRectangle("green_bucket",As,As,As,As,0,0,1.00,0.75,"green_bucket");
+	createRectangle(GREEN_BUCKET,"green_bucket",As,As,As,As,0,0,1.00,0.75);
 	As.r=0.5;
 	As.g=0.5;
 	As.b=0.5;
-	createRectangle("left_wall",As,As,As,As,0,0,8.1,0.1,"wall");
-	createRectangle("bottom_wall",As,As,As,As,0,0,0.2,16.1,"wall");
-	createRectangle("right_wall",As,As,As,As,0,0,8.1,0.1,"wall");
+	createRectangle(LEFT_WALL,"left_wall",As,As,As,As,-3.98,0,8.1,0.1);
+	createRectangle(BOTTOM_WALL,"bottom_wall",As,As,As,As,0,-3.9,0.2,16.1);
+	createRectangle(RIGHT_WALL,"right_wall",As,As,As,As,3.98,0,8.1,0.1);
 	As.r=0.0;
 	As.g=0.0;
 	As.b=0.7;
-	createRectangle("non-rotating",As,As,As,As,0,0,0.6,0.3,"laser");
-	createRectangle("rotating",As,As,As,As,0,0,0.1,0.45,"laser");
+	createRectangle(LASER_BASE,"non-rotating",As,As,As,As,0,0,0.6,0.3);
+	createRectangle(LASER_CANNON,"rotating",As,As,As,As,0,0,0.1,0.45);
 
 	As.r=0.0;
 	As.g=0.8;
 	As.b=0.8;
-	createRectangle("mirror1",As,As,As,As,0.0,0.0,0.03,1.0,"mirror");
-	createRectangle("mirror2",As,As,As,As,0,0,0.03,1.0,"mirror");
-	createRectangle("mirror3",As,As,As,As,0,0,0.03,1.0,"mirror");
+	createRectangle(MIRROR1,"mirror1",As,As,As,As,0.0,-1.8,0.03,1.0);
+	createRectangle(MIRROR2,"mirror2",As,As,As,As,0,2.2,0.03,1.0);
+	createRectangle(MIRROR3,"mirror3",As,As,As,As,3.5,0,0.03,1.0);
+	objects[MIRROR1].angle=M_PI/4;
+	objects[MIRROR2].angle=-M_PI/4;
+	objects[MIRROR3].angle=M_PI/2;
+	for (int id=FIRST_WALL; id<=LAST_WALL; id++)
+		objects[id].fixed=1;
+	for (int id=FIRST_MIRROR; id<=LAST_MIRROR; id++)
+		objects[id].fixed=1;
+	bakeStaticBatch();
+	initLaserSegments();
+	initUnitCircles();
+	initSnapshots();
 
 	cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
 	cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
@@ -1036,11 +3104,63 @@ int main (int argc, char** argv)
 	int width = 1920;
 	int height = 1080;
 	int score =0;
+	long int headless_frames = -1;
+
+	// --headless N : render N frames offscreen, print timing stats and exit
+	// --fps N : draw at most N frames a second, the simulation rate is unaffected
+	// --profile : print min/avg/p99 time of each part of the frame on exit
+	// --profile-csv FILE : same, and write the per-frame times to FILE
+	// --seed N : seed the bricks, so the same input gives the same game
+	// --record FILE : write every key event and the seed to FILE on exit
+	// --replay FILE : play back a recorded game, with its seed, instead of live input
+	game_seed = time(NULL);
+	for (int i=1; i<argc; i++) {
+		if (string(argv[i]) == "--profile")
+			profiler.enabled = true;
+		if (string(argv[i]) == "--profile-csv" && i+1 < argc) {
+			profiler.enabled = true;
+			profiler.csv_path = argv[i+1];
+		}
+		if (string(argv[i]) == "--headless") {
+			// The frame count is optional, so only take the next argument if it is a number
+			char* end = NULL;
+			long int frames = (i+1 < argc) ? strtol(argv[i+1], &end, 10) : 0;
+			headless_frames = (end && end != argv[i+1] && *end == '\0' && frames >= 0) ? frames : 1000;
+		}
+		if (string(argv[i]) == "--fps" && i+1 < argc)
+			max_render_fps = atoi(argv[i+1]);
+		if (string(argv[i]) == "--seed" && i+1 < argc)
+			game_seed = strtoull(argv[i+1], NULL, 10);
+		if (string(argv[i]) == "--record" && i+1 < argc)
+			input_log.record_path = argv[i+1];
+	}
+	// After the loop, so the log's seed wins over --seed
+	for (int i=1; i<argc; i++)
+		if (string(argv[i]) == "--replay" && i+1 < argc)
+			loadInputLog (argv[i+1]);
+	if (input_log.record_path)
+		input_log.recorded.reserve(INPUT_LOG_RESERVE); // recording a key must not grow the vector mid-game
+
+	initArena (tick_arena, "tick", TICK_ARENA_BYTES);
+	initArena (frame_arena, "frame", FRAME_ARENA_BYTES);
+
+	atexit (printProfileSummary); // the game quits through exit() from several callbacks
+	atexit (saveInputLog); // registered before the simulation thread is, so it runs after the join
+
+	if (headless_frames >= 0) {
+		initHeadless (width, height);
+		initGL (width, height);
+		runHeadless (headless_frames);
+		return 0;
+	}
+
     initGLUT (argc, argv, width, height);
 
     addGLUTMenus ();
 
 	initGL (width, height);
+	startSimulationThread ();
+	atexit (stopSimulationThread); // joined before exit() tears the game state down
     glutMainLoop ();
 
 